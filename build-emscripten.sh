@@ -1,21 +1,46 @@
 #!/bin/sh
 
-rm -rf build-wasm
-mkdir -p build-wasm
-#-DCMAKE_FIND_ROOT_PATH=/ is a workaround for find_path when run via EMSCRIPTEN emcmake
-(cd build-wasm && emcmake cmake .. -DCMAKE_FIND_ROOT_PATH=/)
-if [ $retVal -ne 0 ]; then
-    echo "CMAKE FAILED"
-    exit 1
-fi
+# builds one WASM variant: build_variant <build dir> <output name suffix> <cmake options...>
+# each variant has the full module plus the decode-only and encode-only ones
+build_variant() {
+    dir=$1
+    suffix=$2
+    name=kakadujs$suffix
+    shift 2
+    rm -rf $dir
+    mkdir -p $dir
+    #-DCMAKE_FIND_ROOT_PATH=/ is a workaround for find_path when run via EMSCRIPTEN emcmake
+    (cd $dir && emcmake cmake .. -DCMAKE_FIND_ROOT_PATH=/ "$@")
+    retVal=$?
+    if [ $retVal -ne 0 ]; then
+        echo "CMAKE FAILED ($name)"
+        exit 1
+    fi
 
-(cd build-wasm && emmake make VERBOSE=1 -j)
-retVal=$?
-if [ $retVal -ne 0 ]; then
-    echo "MAKE FAILED"
-    exit 1
-fi
-mkdir -p ./dist
-cp ./build-wasm/src/kakadujs.js ./dist
-cp ./build-wasm/src/kakadujs.wasm ./dist
+    (cd $dir && emmake make VERBOSE=1 -j)
+    retVal=$?
+    if [ $retVal -ne 0 ]; then
+        echo "MAKE FAILED ($name)"
+        exit 1
+    fi
+
+    mkdir -p ./dist
+    for module in kakadujs kakadujs-decode kakadujs-encode; do
+        cp ./$dir/src/$module$suffix.js ./dist
+        cp ./$dir/src/$module$suffix.wasm ./dist
+        # older emscripten releases emit a separate pthread worker script
+        if [ -f ./$dir/src/$module$suffix.worker.js ]; then
+            cp ./$dir/src/$module$suffix.worker.js ./dist
+        fi
+    done
+}
+
+# SIMD128 builds plus -nosimd fallbacks; the threaded (-mt) builds need SharedArrayBuffer at runtime.
+# js/kakadujs-loader.js picks the right one at runtime
+build_variant build-wasm ""
+build_variant build-wasm-mt -mt -DKAKADU_THREADING=ON
+build_variant build-wasm-nosimd -nosimd -DKAKADU_WASM_SIMD=OFF
+build_variant build-wasm-mt-nosimd -mt-nosimd -DKAKADU_THREADING=ON -DKAKADU_WASM_SIMD=OFF
+
+cp ./js/kakadujs-loader.js ./js/kakadujs-worker.js ./js/kakadujs-pool.js ./js/kakadujs-stream.js ./dist
 (cd test/node; npm run test)
@@ -0,0 +1,109 @@
+// Copyright (c) Chris Hafey.
+// SPDX-License-Identifier: MIT
+
+// Loads the threaded WASM build (kakadujs-mt) when the environment supports
+// shared memory, otherwise the single threaded build (kakadujs).  Engines
+// without WASM SIMD128 get the matching -nosimd build.
+//
+// The threaded build runs Kakadu's thread pool on Emscripten pthreads, which
+// need SharedArrayBuffer.  Browsers only provide it on cross-origin isolated
+// pages (served with Cross-Origin-Opener-Policy: same-origin and
+// Cross-Origin-Embedder-Policy: require-corp).  Its worker pool is sized from
+// navigator.hardwareConcurrency, which node provides from version 21.
+//
+// Usage:
+//   const { module, threaded, simd, numThreads } = await loadKakadujs('../dist/');
+//
+// Viewers that never encode can load the smaller decode-only module with
+// loadKakadujs('../dist/', true, 'decode') ('encode' for encode-only).
+//   const decoder = new module.HTJ2KDecoder();
+//   decoder.setNumThreads(numThreads);
+
+(function (root, factory) {
+  if (typeof module === 'object' && module.exports) {
+    module.exports = factory();
+  } else {
+    root.loadKakadujs = factory().loadKakadujs;
+  }
+})(typeof self !== 'undefined' ? self : this, function () {
+  const isNode = typeof process !== 'undefined' && process.versions != null && process.versions.node != null;
+
+  function supportsThreads() {
+    if (typeof SharedArrayBuffer === 'undefined' || typeof Atomics === 'undefined') {
+      return false;
+    }
+    if (typeof navigator === 'undefined' || !navigator.hardwareConcurrency) {
+      return false; // the worker pool size comes from navigator.hardwareConcurrency
+    }
+    if (isNode) {
+      return true;
+    }
+    return typeof crossOriginIsolated !== 'undefined' && crossOriginIsolated === true;
+  }
+
+  // smallest module using a SIMD128 instruction (i8x16.splat + i8x16.popcnt),
+  // only engines with SIMD support validate it
+  const simdProbe = new Uint8Array([
+    0, 97, 115, 109, 1, 0, 0, 0, 1, 5, 1, 96, 0, 1, 123, 3, 2, 1, 0, 10, 10, 1, 8, 0, 65, 0, 253, 15, 253, 98, 11,
+  ]);
+
+  function supportsSimd() {
+    try {
+      return typeof WebAssembly === 'object' && WebAssembly.validate(simdProbe);
+    } catch (e) {
+      return false;
+    }
+  }
+
+  function initialized(module) {
+    return new Promise((resolve) => {
+      if (module.calledRun) {
+        resolve(module);
+      } else {
+        module.onRuntimeInitialized = () => resolve(module);
+      }
+    });
+  }
+
+  function loadScript(url) {
+    return new Promise((resolve, reject) => {
+      if (typeof document === 'undefined') {
+        importScripts(url); // web worker
+        resolve();
+        return;
+      }
+      const script = document.createElement('script');
+      script.src = url;
+      script.onload = () => resolve();
+      script.onerror = () => reject(new Error(`Unable to load ${url}`));
+      document.head.appendChild(script);
+    });
+  }
+
+  /// Loads the best build found in distPath.  threads can be set to false to
+  /// force the single threaded build.  variant picks the 'decode' or 'encode'
+  /// only module instead of the full one.  Resolves to the initialized module,
+  /// whether the threaded and SIMD builds were picked and the number of
+  /// additional worker threads to pass to setNumThreads() (one per spare core)
+  async function loadKakadujs(distPath = './dist/', threads = true, variant = '') {
+    const threaded = threads && supportsThreads();
+    const simd = supportsSimd();
+    const name = 'kakadujs' + (variant ? '-' + variant : '') + (threaded ? '-mt' : '') + (simd ? '' : '-nosimd') + '.js';
+    const numThreads = threaded ? Math.max(navigator.hardwareConcurrency - 1, 0) : 0;
+
+    if (isNode) {
+      const path = require('path');
+      const module = require(path.resolve(distPath, name));
+      return { module: await initialized(module), threaded, simd, numThreads };
+    }
+
+    // The non modularized builds pick up a global Module object
+    const global = typeof self !== 'undefined' ? self : window;
+    global.Module = global.Module || {};
+    const ready = initialized(global.Module);
+    await loadScript(distPath + name);
+    return { module: await ready, threaded, simd, numThreads };
+  }
+
+  return { loadKakadujs, supportsThreads, supportsSimd };
+});
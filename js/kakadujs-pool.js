@@ -0,0 +1,227 @@
+// Copyright (c) Chris Hafey.
+// SPDX-License-Identifier: MIT
+
+// Decodes and encodes frames on a pool of workers (Web Workers in browsers,
+// worker_threads in node), each running kakadujs-worker.js with its own
+// HTJ2KDecoder and HTJ2KEncoder.  Frames are handed to the workers as
+// transferred ArrayBuffers and results come back the same way, so nothing
+// goes through a structured clone copy.
+//
+// Transferring detaches the caller's buffer.  The detached input comes back
+// with the result (as encoded or decoded) so it can be reused; pass
+// { transfer: false } to keep it and have the pool copy it instead.
+//
+// Usage:
+//   const pool = new KakadujsPool({ distPath: 'dist/' });
+//   const { frameInfo, decoded } = await pool.decode(encodedArrayBuffer);
+//   const { encoded } = await pool.encode(pixels, frameInfo, { setQuality: [false, 0.001] });
+//   pool.terminate();
+
+(function (root, factory) {
+  if (typeof module === 'object' && module.exports) {
+    module.exports = factory();
+  } else {
+    root.KakadujsPool = factory().KakadujsPool;
+  }
+})(typeof self !== 'undefined' ? self : this, function () {
+  const isNode = typeof process !== 'undefined' && process.versions != null && process.versions.node != null;
+
+  function defaultSize() {
+    if (isNode) {
+      return require('os').cpus().length;
+    }
+    return (typeof navigator !== 'undefined' && navigator.hardwareConcurrency) || 4;
+  }
+
+  // returns an ArrayBuffer holding exactly the bytes of data, which can be an
+  // ArrayBuffer or a TypedArray (e.g. a node Buffer)
+  function toTransferable(data, transfer) {
+    if (data instanceof ArrayBuffer) {
+      return transfer ? data : data.slice(0);
+    }
+    const whole = data.byteOffset === 0 && data.byteLength === data.buffer.byteLength;
+    if (transfer && whole && data.buffer instanceof ArrayBuffer) {
+      return data.buffer;
+    }
+    return data.buffer.slice(data.byteOffset, data.byteOffset + data.byteLength);
+  }
+
+  function createWorker(workerUrl, onMessage, onError) {
+    if (isNode) {
+      const { Worker } = require('worker_threads');
+      const worker = new Worker(workerUrl);
+      worker.on('message', onMessage);
+      worker.on('error', onError);
+      return worker;
+    }
+    const worker = new Worker(workerUrl);
+    worker.onmessage = (event) => onMessage(event.data);
+    worker.onerror = onError;
+    return worker;
+  }
+
+  class KakadujsPool {
+    /// options:
+    ///   distPath  - directory holding the kakadujs builds (default './dist/')
+    ///   workerUrl - kakadujs-worker.js (default: next to the builds)
+    ///   size      - number of workers (default: one per logical core)
+    constructor(options = {}) {
+      // the workers resolve distPath against their own location, so hand
+      // them an absolute one
+      let distPath = options.distPath || './dist/';
+      if (isNode) {
+        distPath = require('path').resolve(distPath) + require('path').sep;
+      } else {
+        distPath = new URL(distPath, location.href).href;
+      }
+      this.distPath_ = distPath;
+      this.workerUrl_ = options.workerUrl || (isNode ? require('path').join(distPath, 'kakadujs-worker.js') : distPath + 'kakadujs-worker.js');
+      const size = options.size || defaultSize();
+
+      this.queue_ = [];
+      this.jobs_ = new Map();
+      this.nextId_ = 1;
+      this.idle_ = [];
+      this.workers_ = [];
+      this.starting_ = size;
+      this.ready = new Promise((resolve, reject) => {
+        this.resolveReady_ = resolve;
+        this.rejectReady_ = reject;
+      });
+      this.ready.catch(() => {}); // rejecting is not an error if nobody waits
+      for (let i = 0; i < size; i++) {
+        this.spawn_();
+      }
+    }
+
+    /// Resolves to { frameInfo, decoded: Uint8Array, encoded: ArrayBuffer }.
+    /// decompositionLevel > 0 decodes a reduced resolution
+    decode(encoded, decompositionLevel = 0, options = {}) {
+      const buffer = toTransferable(encoded, options.transfer !== false);
+      return this.submit_({ type: 'decode', encoded: buffer, decompositionLevel }, [buffer]).then((result) => ({
+        frameInfo: result.frameInfo,
+        decoded: new Uint8Array(result.decoded),
+        encoded: result.encoded,
+      }));
+    }
+
+    /// Resolves to { encoded: Uint8Array, decoded: ArrayBuffer }.  settings
+    /// maps HTJ2KEncoder setter names to argument arrays
+    encode(decoded, frameInfo, settings = {}, options = {}) {
+      const buffer = toTransferable(decoded, options.transfer !== false);
+      return this.submit_({ type: 'encode', decoded: buffer, frameInfo, settings }, [buffer]).then((result) => ({
+        encoded: new Uint8Array(result.encoded),
+        decoded: result.decoded,
+      }));
+    }
+
+    /// Stops the workers, rejecting queued and running jobs and ready if the
+    /// workers had not started yet
+    terminate() {
+      for (const worker of this.workers_) {
+        worker.terminate();
+      }
+      const error = new Error('KakadujsPool terminated');
+      this.rejectReady_(error);
+      for (const job of this.queue_) {
+        job.reject(error);
+      }
+      for (const job of this.jobs_.values()) {
+        job.reject(error);
+      }
+      this.queue_ = [];
+      this.jobs_.clear();
+      this.idle_ = [];
+      this.workers_ = [];
+    }
+
+    spawn_() {
+      let started = false;
+      const worker = createWorker(
+        this.workerUrl_,
+        (message) => {
+          if (message.type === 'ready') {
+            started = true;
+            if (--this.starting_ === 0) {
+              this.resolveReady_();
+            }
+            this.release_(worker);
+          } else {
+            this.complete_(worker, message);
+          }
+        },
+        (error) => this.fail_(worker, error, started)
+      );
+      worker.postMessage({ type: 'init', distPath: this.distPath_ });
+      this.workers_.push(worker);
+    }
+
+    submit_(message, transfer) {
+      return new Promise((resolve, reject) => {
+        message.id = this.nextId_++;
+        this.queue_.push({ message, transfer, resolve, reject });
+        this.dispatch_();
+      });
+    }
+
+    dispatch_() {
+      while (this.idle_.length > 0 && this.queue_.length > 0) {
+        const worker = this.idle_.pop();
+        const job = this.queue_.shift();
+        job.worker = worker;
+        this.jobs_.set(job.message.id, job);
+        worker.postMessage(job.message, job.transfer);
+      }
+    }
+
+    release_(worker) {
+      this.idle_.push(worker);
+      this.dispatch_();
+    }
+
+    complete_(worker, message) {
+      const job = this.jobs_.get(message.id);
+      this.jobs_.delete(message.id);
+      if (job) {
+        if (message.error) {
+          job.reject(new Error(message.error));
+        } else {
+          job.resolve(message);
+        }
+      }
+      this.release_(worker);
+    }
+
+    // A crashed worker is dropped.  One that was running is replaced, one
+    // that failed to start (e.g. a bad distPath) is not, as its replacement
+    // would fail the same way
+    fail_(worker, error, started) {
+      if (!this.workers_.includes(worker)) {
+        return; // terminated, or already handled
+      }
+      for (const [id, job] of this.jobs_) {
+        if (job.worker === worker) {
+          this.jobs_.delete(id);
+          job.reject(error);
+        }
+      }
+      worker.terminate();
+      this.workers_ = this.workers_.filter((w) => w !== worker);
+      this.idle_ = this.idle_.filter((w) => w !== worker);
+      if (started) {
+        this.spawn_();
+        return;
+      }
+      this.rejectReady_(error);
+      if (this.workers_.length === 0) {
+        const noWorkers = new Error('KakadujsPool has no workers');
+        for (const job of this.queue_) {
+          job.reject(noWorkers);
+        }
+        this.queue_ = [];
+      }
+    }
+  }
+
+  return { KakadujsPool };
+});
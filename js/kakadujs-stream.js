@@ -0,0 +1,41 @@
+// Copyright (c) Chris Hafey.
+// SPDX-License-Identifier: MIT
+
+// Progressive decode of a ReadableStream, e.g. the body of a fetch() response.
+// Chunks are copied into the decoder as they arrive and onImage is called with
+// each better image the data so far allows, then once more with the final one.
+//
+// Usage:
+//   const response = await fetch('image.j2c');
+//   decoder.setProgressiveStep(64 * 1024); // optional, see HTJ2KDecoder.hpp
+//   await decodeStream(decoder, response.body, (frameInfo, pixels, final) => draw(frameInfo, pixels));
+//
+// pixels is a view of WASM memory that is only valid until the next image,
+// copy it (pixels.slice()) to keep it.
+
+(function (root, factory) {
+  if (typeof module === 'object' && module.exports) {
+    module.exports = factory();
+  } else {
+    root.decodeStream = factory().decodeStream;
+  }
+})(typeof self !== 'undefined' ? self : this, function () {
+  async function decodeStream(decoder, stream, onImage) {
+    decoder.beginProgressive();
+    const reader = stream.getReader();
+    for (;;) {
+      const { done, value } = await reader.read();
+      if (done) {
+        break;
+      }
+      decoder.getChunkBuffer(value.length).set(value);
+      if (decoder.decodeProgressive()) {
+        onImage(decoder.getFrameInfo(), decoder.getDecodedBuffer(), false);
+      }
+    }
+    decoder.decode();
+    onImage(decoder.getFrameInfo(), decoder.getDecodedBuffer(), true);
+  }
+
+  return { decodeStream };
+});
@@ -0,0 +1,107 @@
+// Copyright (c) Chris Hafey.
+// SPDX-License-Identifier: MIT
+
+// Worker side of kakadujs-pool.js.  Runs as a Web Worker in browsers and as a
+// worker_threads Worker in node, holding one HTJ2KDecoder and one
+// HTJ2KEncoder.  Pixel and codestream data arrive and leave as transferred
+// ArrayBuffers; the only copy is the one out of the WASM heap.
+//
+// Messages (see kakadujs-pool.js):
+//   { type: 'init', distPath }                           -> { type: 'ready' }
+//   { id, type: 'decode', encoded, decompositionLevel }  -> { id, frameInfo, decoded, encoded }
+//   { id, type: 'encode', decoded, frameInfo, settings } -> { id, encoded, decoded }
+// Failed jobs reply { id, error }.
+
+(function () {
+  const isNode = typeof process !== 'undefined' && process.versions != null && process.versions.node != null;
+
+  let port;
+  let loadKakadujs;
+  if (isNode) {
+    port = require('worker_threads').parentPort;
+    loadKakadujs = require('./kakadujs-loader.js').loadKakadujs;
+  } else {
+    port = self;
+    importScripts('kakadujs-loader.js');
+    loadKakadujs = self.loadKakadujs;
+  }
+
+  let module;
+  let decoder;
+  let encoder;
+  let encoderSettings;
+
+  function post(message, transfer) {
+    port.postMessage(message, transfer);
+  }
+
+  function decode(message) {
+    const encoded = new Uint8Array(message.encoded);
+    decoder.getEncodedBuffer(encoded.length).set(encoded);
+    if (message.decompositionLevel) {
+      decoder.decodeSubResolution(message.decompositionLevel);
+    } else {
+      decoder.decode();
+    }
+    // copy out of the WASM heap into a buffer we can hand over without cloning
+    const decoded = decoder.getDecodedBuffer().slice();
+    post(
+      { id: message.id, frameInfo: decoder.getFrameInfo(), decoded: decoded.buffer, encoded: message.encoded },
+      [decoded.buffer, message.encoded]
+    );
+  }
+
+  // settings maps encoder setter names to their arguments, e.g.
+  // { setQuality: [false, 0.001], setDecompositions: [5] }.  The encoder is
+  // recreated when they change so settings never leak between jobs
+  function getEncoder(settings) {
+    const key = JSON.stringify(settings || {});
+    if (!encoder || key !== encoderSettings) {
+      if (encoder) {
+        encoder.delete();
+      }
+      encoder = new module.HTJ2KEncoder();
+      encoderSettings = key;
+      for (const [name, args] of Object.entries(settings || {})) {
+        encoder[name](...args);
+      }
+    }
+    return encoder;
+  }
+
+  function encode(message) {
+    const encoder = getEncoder(message.settings);
+    encoder.getDecodedBuffer(message.frameInfo).set(new Uint8Array(message.decoded));
+    encoder.encode();
+    const encoded = encoder.getEncodedBuffer().slice();
+    post({ id: message.id, encoded: encoded.buffer, decoded: message.decoded }, [encoded.buffer, message.decoded]);
+  }
+
+  async function handle(message) {
+    if (message.type === 'init') {
+      // each worker is one decode lane, so the pool uses the single threaded build
+      module = (await loadKakadujs(message.distPath, false)).module;
+      decoder = new module.HTJ2KDecoder();
+      post({ type: 'ready' });
+      return;
+    }
+    try {
+      if (message.type === 'decode') {
+        decode(message);
+      } else if (message.type === 'encode') {
+        encode(message);
+      } else {
+        throw new Error(`Unknown job type ${message.type}`);
+      }
+    } catch (e) {
+      // embind reports C++ exceptions as a pointer unless built with exception support
+      post({ id: message.id, error: e instanceof Error ? e.message : `kakadujs exception ${e}` });
+    }
+  }
+
+  if (isNode) {
+    port.on('message', handle);
+  } else {
+    port.onmessage = (event) => handle(event.data);
+  }
+})();
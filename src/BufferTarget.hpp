@@ -0,0 +1,67 @@
+// Copyright (c) Chris Hafey.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include "kdu_elementary.h"
+#include "kdu_compressed.h"
+#include <string.h>
+#include <vector>
+
+/// <summary>
+/// Kakadu compressed target that appends to a std::vector
+/// </summary>
+class kdu_buffer_target : public kdu_core::kdu_compressed_target
+{
+public: // Member functions
+  kdu_buffer_target(std::vector<uint8_t> &encoded) : encoded_(encoded), rewritePos_(-1)
+  {
+    encoded_.resize(0);
+  }
+  ~kdu_buffer_target() { return; } // Destructor must be virtual
+  int get_capabilities() { return KDU_TARGET_CAP_SEQUENTIAL /* KDU_TARGET_CAP_CACHED */; }
+  bool write(const kdu_core::kdu_byte *buf, int num_bytes)
+  {
+    if (rewritePos_ >= 0)
+    {
+      // overwriting previously written bytes (e.g. TLM marker segments)
+      if ((size_t)rewritePos_ + num_bytes > encoded_.size())
+      {
+        return false;
+      }
+      memcpy(encoded_.data() + rewritePos_, buf, num_bytes);
+      rewritePos_ += num_bytes;
+      return true;
+    }
+    const size_t size = encoded_.size();
+    encoded_.resize(size + num_bytes);
+    memcpy(encoded_.data() + size, buf, num_bytes);
+    return true;
+  }
+
+  /// Kakadu calls this to go back and fill in the TLM marker segments once
+  /// the tile-part lengths are known
+  bool start_rewrite(kdu_core::kdu_long backtrack)
+  {
+    if (rewritePos_ >= 0 || backtrack < 0 || (size_t)backtrack > encoded_.size())
+    {
+      return false;
+    }
+    rewritePos_ = (kdu_core::kdu_long)encoded_.size() - backtrack;
+    return true;
+  }
+
+  bool end_rewrite()
+  {
+    if (rewritePos_ < 0)
+    {
+      return false;
+    }
+    rewritePos_ = -1;
+    return true;
+  }
+
+private: // Data
+  std::vector<uint8_t> &encoded_;
+  kdu_core::kdu_long rewritePos_;
+};
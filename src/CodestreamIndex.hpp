@@ -0,0 +1,332 @@
+// Copyright (c) Chris Hafey.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <algorithm>
+#include <vector>
+
+/// <summary>
+/// Location of one tile-part and its packets within a file
+/// </summary>
+struct TilePartIndex
+{
+  uint16_t tileIndex;
+  uint8_t tilePartIndex;
+  uint64_t offset;     // offset of the SOT marker
+  uint32_t length;     // Psot - length of the tile-part including its header
+  uint64_t dataOffset; // offset of the first packet (just past SOD)
+  std::vector<uint32_t> packetLengths; // from PLT marker segments, empty if there are none
+};
+
+/// <summary>
+/// Builds an index of the tile-parts and packets in a JPEG 2000 codestream by
+/// walking its marker segments (SOT, PLT, SOD).  Packet lengths are only
+/// available when the codestream carries PLT marker segments.  The index can
+/// be serialized into a UUID box so remote clients can plan byte range reads
+/// without parsing packet headers.  The box payload is (all big endian):
+///   uuid[16]
+///   uint8  version (1)
+///   uint64 main header offset, uint32 main header length
+///   uint32 tile-part count, then for each tile-part:
+///     uint16 tile index, uint8 tile-part index, uint64 SOT offset,
+///     uint32 tile-part length, uint64 first packet offset,
+///     uint32 packet count, uint32 packet length[packet count]
+/// </summary>
+class CodestreamIndex
+{
+public:
+  CodestreamIndex() : mainHeaderOffset_(0), mainHeaderLength_(0) {}
+
+  /// <summary>
+  /// Locates the codestream inside a JP2 family file (jp2c box) or returns the
+  /// whole buffer for a raw codestream.  boxOffset, if supplied, receives the
+  /// offset of the jp2c box header.  Returns false if no codestream is found
+  /// </summary>
+  static bool findCodestream(const uint8_t *data, size_t size, size_t &offset, size_t &length, size_t *boxOffset = nullptr)
+  {
+    if (size >= 2 && data[0] == 0xFF && data[1] == 0x4F) // SOC
+    {
+      offset = 0;
+      length = size;
+      if (boxOffset)
+      {
+        *boxOffset = 0;
+      }
+      return true;
+    }
+    size_t pos = 0;
+    while (pos + 8 <= size)
+    {
+      uint64_t boxLength = readUInt32_(data + pos);
+      const uint32_t boxType = readUInt32_(data + pos + 4);
+      size_t headerLength = 8;
+      if (boxLength == 1)
+      {
+        if (pos + 16 > size)
+        {
+          return false;
+        }
+        boxLength = readUInt64_(data + pos + 8);
+        headerLength = 16;
+      }
+      else if (boxLength == 0)
+      {
+        boxLength = size - pos; // box extends to the end of the file
+      }
+      if (boxLength < headerLength)
+      {
+        return false;
+      }
+      if (boxType == JP2C_BOX_TYPE)
+      {
+        offset = pos + headerLength;
+        length = (size_t)std::min<uint64_t>(boxLength - headerLength, size - offset);
+        if (boxOffset)
+        {
+          *boxOffset = pos;
+        }
+        return true;
+      }
+      pos += (size_t)boxLength;
+    }
+    return false;
+  }
+
+  /// <summary>
+  /// Returns the offset of the first SOT marker, i.e. the length of the main
+  /// header, or 0 if the main header is not complete within size bytes
+  /// </summary>
+  static size_t findMainHeaderEnd(const uint8_t *codestream, size_t size)
+  {
+    if (size < 2 || codestream[0] != 0xFF || codestream[1] != 0x4F)
+    {
+      return 0;
+    }
+    size_t pos = 2;
+    while (pos + 4 <= size)
+    {
+      const uint16_t marker = readUInt16_(codestream + pos);
+      if (marker == SOT_MARKER)
+      {
+        return pos;
+      }
+      pos += 2 + readUInt16_(codestream + pos + 2);
+    }
+    return 0;
+  }
+
+  /// <summary>
+  /// Returns the number of tile-parts that are completely contained in the
+  /// first size bytes of a (possibly still arriving) codestream
+  /// </summary>
+  static size_t countCompleteTileParts(const uint8_t *codestream, size_t size)
+  {
+    size_t pos = findMainHeaderEnd(codestream, size);
+    if (pos == 0)
+    {
+      return 0;
+    }
+    size_t count = 0;
+    while (pos + 12 <= size && readUInt16_(codestream + pos) == SOT_MARKER)
+    {
+      const uint32_t length = readUInt32_(codestream + pos + 6);
+      if (length == 0 || pos + length > size)
+      {
+        break; // a zero Psot runs to the end of the codestream, so it is only complete once all data is in
+      }
+      count++;
+      pos += length;
+    }
+    return count;
+  }
+
+  /// <summary>
+  /// Parses the codestream.  fileOffset is the position of the codestream's
+  /// first byte within the file, it is added to every recorded offset.
+  /// Returns false for a codestream whose tile-parts or marker segments run
+  /// past size
+  /// </summary>
+  bool parse(const uint8_t *codestream, size_t size, uint64_t fileOffset)
+  {
+    tileParts_.clear();
+    const size_t mainHeaderEnd = findMainHeaderEnd(codestream, size);
+    if (mainHeaderEnd == 0)
+    {
+      return false;
+    }
+    mainHeaderOffset_ = fileOffset;
+    mainHeaderLength_ = (uint32_t)mainHeaderEnd;
+
+    size_t pos = mainHeaderEnd;
+    while (pos + 12 <= size && readUInt16_(codestream + pos) == SOT_MARKER)
+    {
+      TilePartIndex tilePart;
+      tilePart.tileIndex = readUInt16_(codestream + pos + 4);
+      tilePart.length = readUInt32_(codestream + pos + 6);
+      tilePart.tilePartIndex = codestream[pos + 10];
+      tilePart.offset = fileOffset + pos;
+      tilePart.dataOffset = 0;
+      if (tilePart.length == 0)
+      {
+        // last tile-part runs up to the EOC marker
+        tilePart.length = (uint32_t)(size - 2 - pos);
+      }
+      if (tilePart.length < 14 || pos + tilePart.length > size)
+      {
+        return false; // shorter than SOT + SOD, or truncated
+      }
+
+      // walk the tile-part header collecting packet lengths up to SOD
+      size_t markerPos = pos + 12;
+      while (markerPos + 2 <= size)
+      {
+        const uint16_t marker = readUInt16_(codestream + markerPos);
+        if (marker == SOD_MARKER)
+        {
+          tilePart.dataOffset = fileOffset + markerPos + 2;
+          break;
+        }
+        if (markerPos + 4 > size)
+        {
+          return false;
+        }
+        const uint16_t segmentLength = readUInt16_(codestream + markerPos + 2);
+        if (segmentLength < 3 || markerPos + 2 + segmentLength > size)
+        {
+          return false;
+        }
+        if (marker == PLT_MARKER)
+        {
+          readPacketLengths_(codestream + markerPos + 5, segmentLength - 3, tilePart.packetLengths);
+        }
+        markerPos += 2 + segmentLength;
+      }
+      tileParts_.push_back(tilePart);
+      pos += tilePart.length;
+    }
+    return !tileParts_.empty();
+  }
+
+  /// <summary>
+  /// Serializes the index as a complete UUID box.  shift is added to every
+  /// offset, e.g. to account for the box itself being inserted ahead of the
+  /// codestream
+  /// </summary>
+  void writeBox(std::vector<uint8_t> &box, uint64_t shift) const
+  {
+    box.clear();
+    appendUInt32_(box, 0); // box length, patched below
+    appendUInt32_(box, UUID_BOX_TYPE);
+    box.insert(box.end(), getIndexUuid_(), getIndexUuid_() + 16);
+    box.push_back(1); // version
+    appendUInt64_(box, mainHeaderOffset_ + shift);
+    appendUInt32_(box, mainHeaderLength_);
+    appendUInt32_(box, (uint32_t)tileParts_.size());
+    for (const TilePartIndex &tilePart : tileParts_)
+    {
+      box.push_back((uint8_t)(tilePart.tileIndex >> 8));
+      box.push_back((uint8_t)tilePart.tileIndex);
+      box.push_back(tilePart.tilePartIndex);
+      appendUInt64_(box, tilePart.offset + shift);
+      appendUInt32_(box, tilePart.length);
+      appendUInt64_(box, tilePart.dataOffset + shift);
+      appendUInt32_(box, (uint32_t)tilePart.packetLengths.size());
+      for (uint32_t packetLength : tilePart.packetLengths)
+      {
+        appendUInt32_(box, packetLength);
+      }
+    }
+    const uint32_t boxLength = (uint32_t)box.size();
+    box[0] = (uint8_t)(boxLength >> 24);
+    box[1] = (uint8_t)(boxLength >> 16);
+    box[2] = (uint8_t)(boxLength >> 8);
+    box[3] = (uint8_t)boxLength;
+  }
+
+  /// <summary>
+  /// Returns the size in bytes of the box written by writeBox()
+  /// </summary>
+  size_t getBoxSize() const
+  {
+    size_t size = 8 + 16 + 1 + 8 + 4 + 4;
+    for (const TilePartIndex &tilePart : tileParts_)
+    {
+      size += 2 + 1 + 8 + 4 + 8 + 4 + 4 * tilePart.packetLengths.size();
+    }
+    return size;
+  }
+
+  const std::vector<TilePartIndex> &getTileParts() const
+  {
+    return tileParts_;
+  }
+
+private:
+  enum
+  {
+    SOT_MARKER = 0xFF90,
+    SOD_MARKER = 0xFF93,
+    PLT_MARKER = 0xFF58,
+    JP2C_BOX_TYPE = 0x6A703263, // 'jp2c'
+    UUID_BOX_TYPE = 0x75756964  // 'uuid'
+  };
+
+  static const uint8_t *getIndexUuid_()
+  {
+    static const uint8_t uuid[16] = {0x3f, 0x8e, 0x52, 0x1c, 0x7a, 0x44, 0x4b, 0x0d,
+                                     0x9e, 0x61, 0x2b, 0xd5, 0x80, 0x73, 0xc1, 0x19};
+    return uuid;
+  }
+
+  /// Iplt holds one length per packet, 7 bits per byte, most significant
+  /// group first with the top bit set on all but the last byte
+  static void readPacketLengths_(const uint8_t *data, size_t size, std::vector<uint32_t> &packetLengths)
+  {
+    uint32_t length = 0;
+    for (size_t i = 0; i < size; i++)
+    {
+      length = (length << 7) | (data[i] & 0x7F);
+      if ((data[i] & 0x80) == 0)
+      {
+        packetLengths.push_back(length);
+        length = 0;
+      }
+    }
+  }
+
+  static uint16_t readUInt16_(const uint8_t *p)
+  {
+    return (uint16_t)((p[0] << 8) | p[1]);
+  }
+
+  static uint32_t readUInt32_(const uint8_t *p)
+  {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+  }
+
+  static uint64_t readUInt64_(const uint8_t *p)
+  {
+    return ((uint64_t)readUInt32_(p) << 32) | readUInt32_(p + 4);
+  }
+
+  static void appendUInt32_(std::vector<uint8_t> &out, uint32_t value)
+  {
+    out.push_back((uint8_t)(value >> 24));
+    out.push_back((uint8_t)(value >> 16));
+    out.push_back((uint8_t)(value >> 8));
+    out.push_back((uint8_t)value);
+  }
+
+  static void appendUInt64_(std::vector<uint8_t> &out, uint64_t value)
+  {
+    appendUInt32_(out, (uint32_t)(value >> 32));
+    appendUInt32_(out, (uint32_t)value);
+  }
+
+  uint64_t mainHeaderOffset_;
+  uint32_t mainHeaderLength_;
+  std::vector<TilePartIndex> tileParts_;
+};
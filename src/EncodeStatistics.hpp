@@ -0,0 +1,51 @@
+// Copyright (c) Chris Hafey.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <vector>
+
+/// <summary>
+/// Distortion of one component between the source image and the encoded
+/// image as a decoder will reconstruct it
+/// </summary>
+struct ComponentStatistics {
+    ComponentStatistics() : meanSquaredError(0.0), peakSignalToNoiseRatio(0.0), maximumError(0) {}
+
+    double meanSquaredError;
+
+    /// <summary>
+    /// In dB relative to the largest value the stored bits can hold.
+    /// Infinite for a lossless component
+    /// </summary>
+    double peakSignalToNoiseRatio;
+
+    uint32_t maximumError;
+};
+
+/// <summary>
+/// Size and (optionally) distortion statistics for the last encode
+/// </summary>
+struct EncodeStatistics {
+    EncodeStatistics() : compressedBytes(0), headerBytes(0), bitsPerPixel(0.0), hasDistortion(false) {}
+
+    /// <summary>
+    /// Size of the encoded output including any file format boxes
+    /// </summary>
+    size_t compressedBytes;
+
+    /// <summary>
+    /// Size of the codestream main header
+    /// </summary>
+    size_t headerBytes;
+
+    double bitsPerPixel;
+
+    /// <summary>
+    /// True when components holds the distortion of each coded component,
+    /// measured exactly by decoding the output (setDistortionStatistics())
+    /// </summary>
+    bool hasDistortion;
+
+    std::vector<ComponentStatistics> components;
+};
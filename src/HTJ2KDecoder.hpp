@@ -3,6 +3,7 @@
 
 #pragma once
 
+#include <algorithm>
 #include <exception>
 #include <memory>
 #include <limits.h>
@@ -22,6 +23,7 @@
 #include <emscripten/val.h>
 #endif
 
+#include "CodestreamIndex.hpp"
 #include "FrameInfo.hpp"
 #include "Point.hpp"
 #include "Size.hpp"
@@ -39,10 +41,25 @@ public:
   /// </summary>
   HTJ2KDecoder()
       : pEncoded_(&encodedInternal_),
-        pDecoded_(&decodedInternal_)
+        externalEncoded_(nullptr),
+        externalEncodedSize_(0),
+        pDecoded_(&decodedInternal_),
+        decodedSize_(0),
+        numThreads_(0),
+        progressiveStep_(0),
+        renderedBytes_(0),
+        renderedTileParts_(0)
   {
   }
 
+  ~HTJ2KDecoder()
+  {
+    releaseThreads();
+  }
+
+  HTJ2KDecoder(const HTJ2KDecoder &) = delete;
+  HTJ2KDecoder &operator=(const HTJ2KDecoder &) = delete;
+
 #ifdef __EMSCRIPTEN__
   /// <summary>
   /// Resizes encoded buffer and returns a TypedArray of the buffer allocated
@@ -53,8 +70,8 @@ public:
   /// </summary>
   emscripten::val getEncodedBuffer(size_t encodedSize)
   {
-    pDecoded_->resize(encodedSize);
-    return emscripten::val(emscripten::typed_memory_view(pDecoded_->size(), pDecoded_->data()));
+    growBuffer_(*pEncoded_, encodedSize);
+    return emscripten::val(emscripten::typed_memory_view(pEncoded_->size(), pEncoded_->data()));
   }
 
   /// <summary>
@@ -63,7 +80,44 @@ public:
   /// </summary>
   emscripten::val getDecodedBuffer()
   {
-    return emscripten::val(emscripten::typed_memory_view(pDecoded_->size(), pDecoded_->data()));
+    uint8_t *decoded = region_.empty() ? pDecoded_->data() : region_.data();
+    return emscripten::val(emscripten::typed_memory_view(decodedSize_, decoded));
+  }
+
+  /// <summary>
+  /// Reserves a region of capacity bytes in WASM memory that every following
+  /// decode writes its pixels to, starting at the first byte, and returns a
+  /// TypedArray of the whole region.  The region never moves, but the view
+  /// is detached whenever WASM memory grows (which any allocation may do,
+  /// even with reserveBuffers()).  JavaScript can keep the view across
+  /// frames as long as it fetches a new one with getDecodedRegion(capacity)
+  /// (same capacity, so nothing moves) when view.byteLength === 0 or
+  /// view.buffer !== module.HEAPU8.buffer.  A frame larger than the region
+  /// fails to decode.  Call with 0 to go back to the internal buffer
+  /// </summary>
+  emscripten::val getDecodedRegion(size_t capacity)
+  {
+    if (capacity == 0)
+    {
+      std::vector<uint8_t>().swap(region_);
+    }
+    else
+    {
+      region_.resize(capacity);
+    }
+    return emscripten::val(emscripten::typed_memory_view(region_.size(), region_.data()));
+  }
+
+  /// <summary>
+  /// Appends chunkSize bytes to the encoded buffer for a progressive decode
+  /// and returns a TypedArray of them for JavaScript to copy the next chunk
+  /// (e.g. from a fetch() ReadableStream) into, see beginProgressive()
+  /// </summary>
+  emscripten::val getChunkBuffer(size_t chunkSize)
+  {
+    const size_t offset = pEncoded_->size();
+    growBuffer_(*pEncoded_, offset + chunkSize);
+    return emscripten::val(emscripten::typed_memory_view(chunkSize, pEncoded_->data() + offset));
   }
 #else
   /// <summary>
@@ -89,6 +143,29 @@ public:
     {
       pEncoded_ = pEncoded;
     }
+    externalEncoded_ = nullptr;
+  }
+
+  /// <summary>
+  /// Decodes straight from size bytes of caller owned memory (e.g. a node
+  /// Buffer) instead of the encoded buffer, so they are never copied.  The
+  /// memory must stay valid until the decode is done.  Set to nullptr to go
+  /// back to the encoded buffer
+  /// </summary>
+  void setEncodedData(uint8_t *data, size_t size)
+  {
+    externalEncoded_ = data;
+    externalEncodedSize_ = data ? size : 0;
+  }
+
+  /// <summary>
+  /// Appends a chunk of a progressively arriving bitstream to the encoded
+  /// buffer, see beginProgressive()
+  /// </summary>
+  void appendEncodedBytes(const uint8_t *data, size_t size)
+  {
+    externalEncoded_ = nullptr;
+    pEncoded_->insert(pEncoded_->end(), data, data + size);
   }
 
   /// <summary>
@@ -118,6 +195,19 @@ public:
 
 #endif
 
+  /// <summary>
+  /// Reserves room for encoded and decoded frames of up to the given sizes
+  /// so a sequence of frames (e.g. cine playback) decodes without growing
+  /// WASM memory.  The buffers never shrink and grow geometrically past
+  /// their capacity, so an occasional larger frame does not lead to a
+  /// reallocation on every frame that follows
+  /// </summary>
+  void reserveBuffers(size_t encodedCapacity, size_t decodedCapacity)
+  {
+    pEncoded_->reserve(encodedCapacity);
+    pDecoded_->reserve(decodedCapacity);
+  }
+
   /// <summary>
   /// Reads the header from an encoded HTJ2K bitstream.  The caller must have
   /// copied the HTJ2K encoded bitstream into the encoded buffer before
@@ -125,7 +215,7 @@ public:
   /// </summary>
   void readHeader()
   {
-    kdu_core::kdu_compressed_source_buffered input(pEncoded_->data(), pEncoded_->size());
+    kdu_core::kdu_compressed_source_buffered input(getEncodedData_(), getEncodedSize_());
     kdu_core::kdu_codestream codestream;
     readHeader_(codestream, input);
     codestream.destroy();
@@ -157,7 +247,7 @@ public:
   void decode()
   {
     kdu_core::kdu_codestream codestream;
-    kdu_core::kdu_compressed_source_buffered input(pEncoded_->data(), pEncoded_->size());
+    kdu_core::kdu_compressed_source_buffered input(getEncodedData_(), getEncodedSize_());
     readHeader_(codestream, input);
     decode_(codestream, input, 0);
     codestream.destroy();
@@ -173,13 +263,78 @@ public:
   void decodeSubResolution(size_t decompositionLevel)
   {
     kdu_core::kdu_codestream codestream;
-    kdu_core::kdu_compressed_source_buffered input(pEncoded_->data(), pEncoded_->size());
+    kdu_core::kdu_compressed_source_buffered input(getEncodedData_(), getEncodedSize_());
     readHeader_(codestream, input);
     decode_(codestream, input, decompositionLevel);
     codestream.destroy();
     input.close();
   }
 
+  /// <summary>
+  /// Starts a progressive decode of a bitstream that arrives in chunks.  Empties
+  /// the encoded buffer; append each chunk with getChunkBuffer() (JavaScript)
+  /// or appendEncodedBytes() (C++) and call decodeProgressive() after it.
+  /// Once the last chunk is in, decode() produces the final image
+  /// </summary>
+  void beginProgressive()
+  {
+    externalEncoded_ = nullptr;
+    pEncoded_->clear();
+    renderedBytes_ = 0;
+    renderedTileParts_ = 0;
+  }
+
+  /// <summary>
+  /// Sets how often decodeProgressive() renders: whenever another bytes of
+  /// codestream have arrived since the last image.  With 0 (the default) it
+  /// only renders when a tile-part completes, which for a codestream divided
+  /// into tile-parts by resolution (ORGtparts=R, e.g. RPCL) is after each
+  /// resolution level
+  /// </summary>
+  void setProgressiveStep(size_t bytes)
+  {
+    progressiveStep_ = bytes;
+  }
+
+  /// <summary>
+  /// Decodes the best image the data received so far allows, if the main
+  /// header is complete and a new tile-part or progressive step (see
+  /// setProgressiveStep()) has arrived since the last image.  Missing data
+  /// decodes as if it had been truncated, so early images are blurry.
+  /// Returns true when a new image is in the decoded buffer
+  /// </summary>
+  bool decodeProgressive()
+  {
+    size_t offset;
+    size_t length;
+    if (!CodestreamIndex::findCodestream(getEncodedData_(), getEncodedSize_(), offset, length))
+    {
+      return false; // the jp2c box header has not arrived yet
+    }
+    uint8_t *data = getEncodedData_() + offset;
+    if (CodestreamIndex::findMainHeaderEnd(data, length) == 0)
+    {
+      return false;
+    }
+    const size_t tileParts = CodestreamIndex::countCompleteTileParts(data, length);
+    const bool stepReached = progressiveStep_ != 0 && length >= renderedBytes_ + progressiveStep_;
+    if (tileParts <= renderedTileParts_ && !stepReached)
+    {
+      return false;
+    }
+
+    // decode the raw codestream, a partial jp2 box structure would not parse
+    kdu_core::kdu_codestream codestream;
+    kdu_core::kdu_compressed_source_buffered input(data, length);
+    readHeader_(codestream, input);
+    decode_(codestream, input, 0);
+    codestream.destroy();
+    input.close();
+    renderedBytes_ = length;
+    renderedTileParts_ = tileParts;
+    return true;
+  }
+
   /// <summary>
   /// returns the FrameInfo object for the decoded image.
   /// </summary>
@@ -249,7 +404,106 @@ public:
     return isHTEnabled_;
   }
 
+  /// <summary>
+  /// Sets the number of additional Kakadu worker threads used by decode().
+  /// 0 (the default) decodes on the calling thread only.  The threads are
+  /// started on the first decode and kept for later ones, which may run on
+  /// other threads as long as two never run at once.  Builds without
+  /// threading (KDU_NO_THREADS) ignore this
+  /// </summary>
+  void setNumThreads(size_t numThreads)
+  {
+    if (numThreads != numThreads_)
+    {
+      releaseThreads();
+    }
+    numThreads_ = numThreads;
+  }
+
+  /// <summary>
+  /// Stops the worker threads started by decode(), which otherwise live as
+  /// long as the decoder.  The next decode starts them again
+  /// </summary>
+  void releaseThreads()
+  {
+    if (env_.exists())
+    {
+      env_.change_group_owner_thread();
+      env_.destroy();
+    }
+  }
+
 private:
+  /// The bytes to decode - the caller's memory set by setEncodedData() or the
+  /// encoded buffer
+  uint8_t *getEncodedData_()
+  {
+    return externalEncoded_ ? externalEncoded_ : pEncoded_->data();
+  }
+
+  size_t getEncodedSize_() const
+  {
+    return externalEncoded_ ? externalEncodedSize_ : pEncoded_->size();
+  }
+
+  /// Resizes buffer to size, growing its capacity at least geometrically.
+  /// Shrinking keeps the capacity
+  static void growBuffer_(std::vector<uint8_t> &buffer, size_t size)
+  {
+    if (size > buffer.capacity())
+    {
+      buffer.reserve(std::max(size, buffer.capacity() * 2));
+    }
+    buffer.resize(size);
+  }
+
+  /// Returns where the next decoded frame of size bytes goes: the caller
+  /// reserved region if there is one, otherwise the decoded buffer
+  kdu_core::kdu_byte *prepareDecoded_(size_t size)
+  {
+    if (!region_.empty())
+    {
+      if (size > region_.size())
+      {
+        kdu_core::kdu_error e;
+        e << "The decoded frame does not fit in the reserved decoded region.";
+      }
+      decodedSize_ = size;
+      return region_.data();
+    }
+    growBuffer_(*pDecoded_, size);
+    decodedSize_ = size;
+    return pDecoded_->data();
+  }
+
+  /// Returns the thread pool for this decoder, or nullptr to decode on the
+  /// calling thread.  The pool is started by the first decode.  A Kakadu
+  /// thread group is driven by its owner thread, so ownership moves to the
+  /// calling thread in case this decode runs on a different one
+  kdu_core::kdu_thread_env *getThreadEnv_()
+  {
+    if (numThreads_ == 0)
+    {
+      return nullptr;
+    }
+    if (env_.exists())
+    {
+      env_.change_group_owner_thread();
+    }
+    else
+    {
+      env_.create();
+      for (size_t i = 0; i < numThreads_; i++)
+      {
+        if (!env_.add_thread())
+        {
+          break; // no (more) threads available on this platform
+        }
+      }
+    }
+    return &env_;
+  }
+
   void readHeader_(kdu_core::kdu_codestream &codestream, kdu_core::kdu_compressed_source_buffered &source)
   {
     kdu_supp::jp2_family_src jp2_ultimate_src;
@@ -303,20 +557,26 @@ private:
     cod->get(Creversible, 0, 0, isReversible_);
     cod->get(Cblk, 0, 0, (int &)blockDimensions_.height);
     cod->get(Cblk, 0, 1, (int &)blockDimensions_.width);
+    isUsingColorTransform_ = false;
+    cod->get(Cycc, 0, 0, isUsingColorTransform_);
 
     isHTEnabled_ = codestream.get_ht_usage();
-    size_t bytesPerPixel = (frameInfo_.bitsPerSample + 1) / 8;
+    size_t bytesPerPixel = (frameInfo_.bitsPerSample + 8 - 1) / 8;
     // Now decompress the image in one hit, using `kdu_stripe_decompressor'
     size_t num_samples = kdu_core::kdu_memsafe_mul(frameInfo_.componentCount,
                                                    kdu_core::kdu_memsafe_mul(frameInfo_.width,
                                                                              frameInfo_.height));
-    pDecoded_->resize(num_samples * bytesPerPixel);
-    kdu_core::kdu_byte *buffer = pDecoded_->data();
+    kdu_core::kdu_byte *buffer = prepareDecoded_(num_samples * bytesPerPixel);
     kdu_supp::kdu_stripe_decompressor decompressor;
-    decompressor.start(codestream);
+    kdu_core::kdu_thread_env *pEnv = getThreadEnv_();
+    decompressor.start(codestream, false, false, pEnv);
     int stripe_heights[3] = {frameInfo_.height, frameInfo_.height, frameInfo_.height};
 
     bool is_signed[3] = {frameInfo_.isSigned, frameInfo_.isSigned, frameInfo_.isSigned};
+    int precisions[3] = {frameInfo_.bitsPerSample, frameInfo_.bitsPerSample, frameInfo_.bitsPerSample};
+    // the stripe decompressor converts (and narrows) Kakadu's line samples
+    // straight into buffer.  A separate narrowing pass over its output would
+    // only add a copy, so there is no SIMD128 kernel of our own here
     if (bytesPerPixel == 1)
     {
       decompressor.pull_stripe((kdu_core::kdu_byte *)buffer, stripe_heights);
@@ -329,19 +589,29 @@ private:
           NULL,      // sample_offsets
           NULL,      // sample_gaps
           NULL,      // row_gaps
-          NULL,      // precisions
+          precisions, // precisions
           is_signed, // is_signed
           NULL,      // pad_flags
           0          // vectorized_store_prefs
       );
     }
     decompressor.finish();
+
+    // the thread pool outlives this codestream
+    if (pEnv != nullptr)
+    {
+      pEnv->cs_terminate(codestream);
+    }
   }
 
   std::vector<uint8_t> *pEncoded_;
+  uint8_t *externalEncoded_;
+  size_t externalEncodedSize_;
   std::vector<uint8_t> *pDecoded_;
   std::vector<uint8_t> encodedInternal_;
   std::vector<uint8_t> decodedInternal_;
+  std::vector<uint8_t> region_;
+  size_t decodedSize_;
 
   // std::vector<uint8_t> encoded_;
   // std::vector<uint8_t> decoded_;
@@ -353,4 +623,9 @@ private:
   Size blockDimensions_;
   bool isUsingColorTransform_;
   bool isHTEnabled_;
+  size_t numThreads_;
+  size_t progressiveStep_;
+  size_t renderedBytes_;
+  size_t renderedTileParts_;
+  kdu_core::kdu_thread_env env_;
 };
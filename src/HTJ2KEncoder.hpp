@@ -5,14 +5,28 @@
 
 // Kakadu core includes
 #include "kdu_elementary.h"
+#include "kdu_arch.h"
 #include "kdu_messaging.h"
 #include "kdu_params.h"
 #include "kdu_compressed.h"
 #include "kdu_sample_processing.h"
+#include "kdu_roi_processing.h"
 #include "kdu_utils.h"
 #include "jp2.h"
+#include "Point.hpp"
 #include "Size.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <exception>
+#include <limits>
+#include <memory>
+#include <string>
 #include <vector>
+#ifndef KDU_NO_THREADS
+#include <thread>
+#endif
 
 // Application level includes
 #include "kdu_stripe_compressor.h"
@@ -20,29 +34,20 @@
 #ifdef __EMSCRIPTEN__
 #include <emscripten/val.h>
 #endif
+#ifdef __wasm_simd128__
+#include <wasm_simd128.h>
+#endif
 
-#include "FrameInfo.hpp"
-
-class kdu_buffer_target : public kdu_core::kdu_compressed_target
-{
-public: // Member functions
-  kdu_buffer_target(std::vector<uint8_t> &encoded) : encoded_(encoded)
-  {
-    encoded_.resize(0);
-  }
-  ~kdu_buffer_target() { return; } // Destructor must be virtual
-  int get_capabilities() { return KDU_TARGET_CAP_SEQUENTIAL /* KDU_TARGET_CAP_CACHED */; }
-  bool write(const kdu_core::kdu_byte *buf, int num_bytes)
-  {
-    const size_t size = encoded_.size();
-    encoded_.resize(size + num_bytes);
-    memcpy(encoded_.data() + size, buf, num_bytes);
-    return true;
-  }
+#ifndef KAKADUJS_ENCODE_ONLY
+#include "kdu_stripe_decompressor.h"
+#endif
 
-private: // Data
-  std::vector<uint8_t> &encoded_;
-};
+#include "BufferTarget.hpp"
+#include "CodestreamIndex.hpp"
+#include "EncodeStatistics.hpp"
+#include "FrameInfo.hpp"
+#include "RegionOfInterest.hpp"
+#include "SourceDescriptor.hpp"
 
 /// <summary>
 /// JavaScript API for encoding images to HTJ2K bitstreams with OpenJPH
@@ -60,11 +65,44 @@ public:
                    blockDimensions_(64, 64),
                    htEnabled_(true),
                    qfactor(85),
+                   targetSize_(0),
+                   targetBitrate_(0.0f),
+                   tlmEnabled_(false),
+                   pltEnabled_(false),
+                   tilePartDivision_(0),
+                   tileSize_(0, 0),
+                   qualityLayers_(1),
+                   roiOrigin_(0, 0),
+                   roiSize_(0, 0),
+                   numThreads_(2),
+                   colorTransform_(true),
+                   dropAlpha_(false),
+                   fileFormat_(0),
+                   codestreamIndex_(false),
+                   autoPrecision_(false),
+                   distortionStatistics_(false),
+                   detectedMinimum_(0),
+                   detectedMaximum_(0),
+                   parametersDirty_(true),
+                   parametersGeneration_(0),
+                   copiedGeneration_(std::numeric_limits<size_t>::max()),
                    buf_(nullptr),
                    size_(0)
   {
   }
 
+  ~HTJ2KEncoder()
+  {
+    if (codestream_.exists())
+    {
+      codestream_.destroy();
+    }
+  }
+
+  // the encoder owns a kakadu codestream which cannot be shared
+  HTJ2KEncoder(const HTJ2KEncoder &) = delete;
+  HTJ2KEncoder &operator=(const HTJ2KEncoder &) = delete;
+
 #ifdef __EMSCRIPTEN__
   /// <summary>
   /// Resizes the decoded buffer to accomodate the specified frameInfo.
@@ -82,9 +120,7 @@ public:
   emscripten::val getDecodedBuffer(const FrameInfo &frameInfo)
   {
     frameInfo_ = frameInfo;
-    const size_t bytesPerPixel = (frameInfo_.bitsPerSample + 8 - 1) / 8;
-    const size_t decodedSize = frameInfo_.width * frameInfo_.height * frameInfo_.componentCount * bytesPerPixel;
-    decoded_.resize(decodedSize);
+    decoded_.resize(getSourceSize_());
     return emscripten::val(emscripten::typed_memory_view(decoded_.size(), decoded_.data()));
   }
 
@@ -116,6 +152,15 @@ public:
     size_ = size;
   }
 
+  /// <summary>
+  /// Returns the number of source bytes encode() reads for the FrameInfo and
+  /// source descriptor set.  A smaller source image is rejected by encode()
+  /// </summary>
+  size_t getSourceSize() const
+  {
+    return getSourceSize_();
+  }
+
   /// <summary>
   /// Returns the buffer to store the encoded bytes.  This method is not
   /// exported to JavaScript, it is intended to be called by C++ code
@@ -124,14 +169,139 @@ public:
   {
     return encoded_;
   }
+
+  /// <summary>
+  /// Swaps the encoded bytes into encoded, handing them over without a copy.
+  /// The buffer keeps the capacity encode() reserves (the raw frame size),
+  /// and the next encode() has to grow a new one, so prefer copying from
+  /// getEncodedBytes() when the codestream is kept around.  This method is
+  /// not exported to JavaScript, it is intended to be called by C++ code
+  /// </summary>
+  void swapEncodedBytes(std::vector<uint8_t> &encoded)
+  {
+    encoded.swap(encoded_);
+  }
+
+  /// <summary>
+  /// Encodes a series of frames that share the same FrameInfo using the
+  /// current encoder settings.  Frames are distributed over a pool of
+  /// workers, each of which owns its own encoder that is reused for every
+  /// frame it encodes and kept across calls.  encoded[i] receives a copy of
+  /// the codestream for frames[i], sized to it, while the workers keep their
+  /// frame sized buffers for the next frame.  numWorkers = 0 uses one worker
+  /// per processor.
+  /// This method is not exported to JavaScript, it is intended to be
+  /// called by C++ code
+  /// </summary>
+  void encodeBatch(const std::vector<uint8_t *> &frames, const FrameInfo &frameInfo,
+                   std::vector<std::vector<uint8_t>> &encoded, size_t numWorkers = 0)
+  {
+    encoded.resize(frames.size());
+    if (frames.empty())
+    {
+      return;
+    }
+
+#ifdef KDU_NO_THREADS
+    numWorkers = 1;
+#else
+    if (numWorkers == 0)
+    {
+      numWorkers = std::thread::hardware_concurrency();
+    }
+#endif
+    numWorkers = std::max<size_t>(1, std::min(numWorkers, frames.size()));
+
+    // workers run single threaded, the parallelism comes from the frames
+    while (batchWorkers_.size() < numWorkers)
+    {
+      batchWorkers_.emplace_back(new HTJ2KEncoder());
+    }
+    for (size_t i = 0; i < numWorkers; i++)
+    {
+      copyParameters_(*batchWorkers_[i]);
+      batchWorkers_[i]->frameInfo_ = frameInfo;
+      batchWorkers_[i]->numThreads_ = 0;
+    }
+
+    const size_t frameSize = batchWorkers_[0]->getSourceSize_();
+    std::atomic<size_t> nextFrame(0);
+    std::vector<std::exception_ptr> errors(numWorkers);
+
+    auto run = [&](size_t workerIndex)
+    {
+      HTJ2KEncoder &worker = *batchWorkers_[workerIndex];
+      try
+      {
+        for (size_t i = nextFrame++; i < frames.size(); i = nextFrame++)
+        {
+          worker.setSourceImage(frames[i], frameSize);
+          worker.encode();
+          encoded[i].assign(worker.encoded_.begin(), worker.encoded_.end());
+        }
+      }
+      catch (...)
+      {
+        errors[workerIndex] = std::current_exception();
+        nextFrame = frames.size();
+      }
+    };
+
+#ifdef KDU_NO_THREADS
+    run(0);
+#else
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < numWorkers; i++)
+    {
+      threads.emplace_back(run, i);
+    }
+    run(0);
+    for (auto &thread : threads)
+    {
+      thread.join();
+    }
+#endif
+
+    for (auto &error : errors)
+    {
+      if (error)
+      {
+        std::rethrow_exception(error);
+      }
+    }
+  }
 #endif
 
   /// <summary>
-  /// Sets the number of wavelet decompositions and clears any precincts
+  /// Sets the number of additional Kakadu worker threads used by encode().
+  /// 0 encodes on the calling thread only
+  /// </summary>
+  void setNumThreads(size_t numThreads)
+  {
+    numThreads_ = numThreads;
+  }
+
+  /// <summary>
+  /// Sets the number of wavelet decompositions
   /// </summary>
   void setDecompositions(size_t decompositions)
   {
     decompositions_ = decompositions;
+    parametersChanged_();
+  }
+
+  /// <summary>
+  /// Sets the precinct dimensions for each resolution.  The first entry
+  /// applies to the highest resolution, the second entry to the next lower
+  /// resolution and so on.  The last entry is used for any remaining lower
+  /// resolutions.  Dimensions must be powers of 2 and there can be no more
+  /// entries than resolutions (decompositions + 1); encode() throws
+  /// otherwise.  An empty list restores the default maximal precincts
+  /// </summary>
+  void setPrecincts(const std::vector<Size> &precincts)
+  {
+    precincts_ = precincts;
+    parametersChanged_();
   }
 
   /// <summary>
@@ -143,6 +313,7 @@ public:
   {
     lossless_ = lossless;
     quantizationStep_ = quantizationStep;
+    parametersChanged_();
   }
 
   /// <summary>
@@ -157,6 +328,31 @@ public:
       qf = 100;
     }
     qfactor = qf;
+    parametersChanged_();
+  }
+
+  /// <summary>
+  /// Sets the target size in bytes for lossy encodes.  When non zero, the
+  /// encoder uses HT complexity constrained rate control (Cplex) to hit the
+  /// target in a single coding pass instead of Qfactor.  With HT disabled the
+  /// Part-1 coder codes every pass and standard PCRD truncation sizes the
+  /// codestream instead.  Ignored when lossless.  Set to 0 to disable.
+  /// </summary>
+  void setTargetSize(size_t targetSize)
+  {
+    targetSize_ = targetSize;
+    parametersChanged_();
+  }
+
+  /// <summary>
+  /// Sets the target bitrate in bits per pixel for lossy encodes.  This is
+  /// an alternative to setTargetSize() and is converted to a byte budget
+  /// using the frame dimensions.  Set to 0 to disable.
+  /// </summary>
+  void setTargetBitrate(float bitsPerPixel)
+  {
+    targetBitrate_ = bitsPerPixel;
+    parametersChanged_();
   }
 
   /// <summary>
@@ -170,6 +366,7 @@ public:
   void setProgressionOrder(size_t progressionOrder)
   {
     progressionOrder_ = progressionOrder;
+    parametersChanged_();
   }
 
   /// <summary>
@@ -178,6 +375,25 @@ public:
   void setBlockDimensions(Size blockDimensions)
   {
     blockDimensions_ = blockDimensions;
+    parametersChanged_();
+  }
+
+  /// <summary>
+  /// Applies a speed/size preset.  Each preset starts from the encoder
+  /// defaults (HT, 64x64 blocks, 5 decompositions, RPCL) and changes only the
+  /// setting its name implies; any of these can still be overridden
+  /// afterwards.  Finer choices (block shapes, decompositions by geometry)
+  /// wait for measurements from 'cpptest <iterations> presets'
+  /// 0 = fastest (3 decompositions)
+  /// 1 = balanced (the encoder defaults)
+  /// 2 = smallest (Part 1 block coder)
+  /// </summary>
+  void setPreset(size_t preset)
+  {
+    setHTEnabled(preset != 2);
+    setBlockDimensions(Size(64, 64));
+    setDecompositions(preset == 0 ? 3 : 5);
+    setProgressionOrder(2); // RPCL
   }
 
   /// <summary>
@@ -186,6 +402,211 @@ public:
   void setHTEnabled(bool htEnabled)
   {
     htEnabled_ = htEnabled;
+    parametersChanged_();
+  }
+
+  /// <summary>
+  /// Describes the memory layout of the source image: row stride, planar or
+  /// interleaved components, byte order and the stored bits within each
+  /// sample.  Samples are normalized stripe by stripe as they are handed to
+  /// Kakadu so no full frame copy is made.  For the JavaScript API, set the
+  /// descriptor before calling getDecodedBuffer() so the buffer is sized for it.
+  /// Throws if the stored bits do not fit in a 16 bit sample below highBit.
+  /// The row stride must be a whole number of samples, which encode() checks
+  /// once the sample size is known
+  /// </summary>
+  void setSourceDescriptor(const SourceDescriptor &sourceDescriptor)
+  {
+    if (sourceDescriptor.bitsStored != 0 &&
+        (sourceDescriptor.bitsStored > 16 || sourceDescriptor.highBit > 15 ||
+         sourceDescriptor.highBit + 1 < sourceDescriptor.bitsStored))
+    {
+      kdu_core::kdu_error e;
+      e << "The source bitsStored must be at most 16 and no more than highBit + 1, with highBit at most 15.";
+    }
+    sourceDescriptor_ = sourceDescriptor;
+  }
+
+  /// <summary>
+  /// Enables the reversible (RCT) or irreversible (ICT) colour transform for
+  /// three component images, matching the lossless setting.  Enabled by
+  /// default.  Source images with more than one component must be interleaved
+  /// (e.g. RGBRGB...)
+  /// </summary>
+  void setColorTransform(bool colorTransform)
+  {
+    colorTransform_ = colorTransform;
+    parametersChanged_();
+  }
+
+  /// <summary>
+  /// When enabled, four component (RGBA) source images are encoded as three
+  /// component (RGB) images and the alpha channel is discarded
+  /// </summary>
+  void setDropAlpha(bool dropAlpha)
+  {
+    dropAlpha_ = dropAlpha;
+  }
+
+  /// <summary>
+  /// Enables automatic precision detection.  When enabled, encode() scans
+  /// the samples of frames with more than 8 bits per sample and codes them
+  /// with the smallest precision and signedness that holds their actual
+  /// range instead of bitsPerSample.  Fewer bit-planes are then coded.  The
+  /// detected range is available from getDetectedMinimum() and
+  /// getDetectedMaximum() after encode()
+  /// </summary>
+  void setAutoPrecision(bool autoPrecision)
+  {
+    autoPrecision_ = autoPrecision;
+  }
+
+  /// <summary>
+  /// Opt-in exact distortion measurement, off by default.  When enabled,
+  /// encode() decodes the codestream it just produced and measures the mean
+  /// squared error, PSNR and maximum error of each component against the
+  /// source.  This is a full decode pass on top of the encode, costing about
+  /// as much as decode(); it only saves the full size decoded image, since
+  /// each reconstructed stripe is compared with the source and dropped.
+  /// Kakadu keeps the block coder's distortion estimates internal to its
+  /// rate control, so there is no cheaper estimated mode.  Lossless encodes
+  /// report zero error without decoding.  The size statistics are always
+  /// collected and cost nothing.  The encode-only WASM module
+  /// (KAKADUJS_ENCODE_ONLY) has no decoder and ignores this, its statistics
+  /// never have distortion
+  /// </summary>
+  void setDistortionStatistics(bool distortionStatistics)
+  {
+    distortionStatistics_ = distortionStatistics;
+  }
+
+  /// <summary>
+  /// Returns the size (and, if enabled, distortion) statistics of the last
+  /// encode()
+  /// </summary>
+  const EncodeStatistics &getStatistics() const
+  {
+    return statistics_;
+  }
+
+  /// <summary>
+  /// Returns the smallest sample value found by the last encode() with
+  /// automatic precision enabled
+  /// </summary>
+  int32_t getDetectedMinimum() const
+  {
+    return detectedMinimum_;
+  }
+
+  /// <summary>
+  /// Returns the largest sample value found by the last encode() with
+  /// automatic precision enabled
+  /// </summary>
+  int32_t getDetectedMaximum() const
+  {
+    return detectedMaximum_;
+  }
+
+  /// <summary>
+  /// Sets the tile size.  A size of 0x0 (the default) produces a single tile
+  /// covering the whole image.  Tiles are compressed concurrently on the
+  /// encoder's thread pool
+  /// </summary>
+  void setTileSize(Size tileSize)
+  {
+    tileSize_ = tileSize;
+    parametersChanged_();
+  }
+
+  /// <summary>
+  /// Enables writing of tile-part length (TLM) marker segments in the main
+  /// header so decoders can locate tile-parts without walking the codestream
+  /// </summary>
+  void setTLMEnabled(bool tlmEnabled)
+  {
+    tlmEnabled_ = tlmEnabled;
+    parametersChanged_();
+  }
+
+  /// <summary>
+  /// Enables writing of packet length (PLT) marker segments in each tile-part
+  /// header so decoders can locate packets without parsing packet headers
+  /// </summary>
+  void setPLTEnabled(bool pltEnabled)
+  {
+    pltEnabled_ = pltEnabled;
+    parametersChanged_();
+  }
+
+  /// <summary>
+  /// Sets how each tile is divided into tile-parts
+  /// 0 = single tile-part per tile
+  /// 1 = one tile-part per resolution
+  /// 2 = one tile-part per component
+  /// 3 = one tile-part per quality layer
+  /// </summary>
+  void setTilePartDivision(size_t tilePartDivision)
+  {
+    tilePartDivision_ = tilePartDivision;
+    parametersChanged_();
+  }
+
+  /// <summary>
+  /// Sets the number of quality layers.  With more than one layer, and a
+  /// layer-first progression order (LRCP), the leading bytes of the
+  /// codestream hold a coarse version of the whole image that is refined by
+  /// each following layer.  The HT block coder emits a single HT set per
+  /// code-block, so the layers are most effective with setHTEnabled(false)
+  /// </summary>
+  void setQualityLayers(size_t qualityLayers)
+  {
+    qualityLayers_ = std::max<size_t>(qualityLayers, 1);
+    parametersChanged_();
+  }
+
+  /// <summary>
+  /// Codes the rectangle at origin with the given size ahead of the rest of
+  /// the image, using the max-shift region of interest method (RGN marker).
+  /// The wavelet coefficients contributing to the rectangle are shifted above
+  /// every background bit-plane, so rate control spends the byte budget on
+  /// the region until it is complete and only then on the background.  With
+  /// several quality layers and a layer-first progression (LRCP) the region
+  /// is also what the leading bytes of the codestream hold; with a single
+  /// layer it only wins the byte budget.  The total size is unchanged.
+  ///
+  /// The region only acts through rate control, so encode() throws unless a
+  /// target size or bitrate is set (setTargetSize(), setTargetBitrate()).
+  /// The tiling is left alone.  The frame is held as 16 bit samples while
+  /// it is coded.  An empty size disables the region
+  /// </summary>
+  void setRegionOfInterest(Point origin, Size size)
+  {
+    roiOrigin_ = origin;
+    roiSize_ = size;
+    parametersChanged_();
+  }
+
+  /// <summary>
+  /// Sets the output file format
+  /// 0 = raw J2C codestream
+  /// 1 = JP2 file (written with the JPH brand when HT is enabled)
+  /// </summary>
+  void setFileFormat(size_t fileFormat)
+  {
+    fileFormat_ = fileFormat;
+    parametersChanged_();
+  }
+
+  /// <summary>
+  /// When enabled and a file format other than J2C is selected, a UUID box
+  /// indexing the offsets of every tile-part and packet is written ahead of
+  /// the codestream box (see CodestreamIndex.hpp for the layout).  Packet
+  /// length markers (PLT) are generated automatically to build it
+  /// </summary>
+  void setCodestreamIndex(bool codestreamIndex)
+  {
+    codestreamIndex_ = codestreamIndex;
+    parametersChanged_();
   }
 
   /// <summary>
@@ -196,127 +617,992 @@ public:
   /// </summary>
   void encode()
   {
-    // resize the encoded buffer so we don't have to keep resizing it
-    const size_t bytesPerPixel = (frameInfo_.bitsPerSample + 8 - 1) / 8;
-    encoded_.reserve(frameInfo_.width * frameInfo_.height * frameInfo_.componentCount * bytesPerPixel);
-
-    //  Construct code-stream object
-    kdu_core::siz_params siz;
-    siz.set(Scomponents, 0, 0, frameInfo_.componentCount);
-    siz.set(Sdims, 0, 0, frameInfo_.height);
-    siz.set(Sdims, 0, 1, frameInfo_.width);
-    siz.set(Sprecision, 0, 0, frameInfo_.bitsPerSample);
-    siz.set(Ssigned, 0, 0, frameInfo_.isSigned);
-    kdu_core::kdu_params *siz_ref = &siz;
-    siz_ref->finalize();
+    try
+    {
+      encodeFrame_();
+    }
+    catch (...)
+    {
+      // A failed encode leaves the cached codestream part way through a frame
+      // and attached to a target that no longer exists, so it must not be
+      // restarted by the next encode
+      if (codestream_.exists())
+      {
+        codestream_.destroy();
+      }
+      parametersDirty_ = true;
+      throw;
+    }
+  }
+
+private:
+  enum
+  {
+    STRIPE_HEIGHT = 64 // rows normalized per push_stripe() call
+  };
+
+  void encodeFrame_()
+  {
+    if ((buf_ ? size_ : decoded_.size()) < getSourceSize_())
+    {
+      kdu_core::kdu_error e;
+      e << "The source image is smaller than its FrameInfo and source descriptor describe.";
+    }
+    if (sourceDescriptor_.rowStride % getBytesPerSample_() != 0)
+    {
+      kdu_core::kdu_error e;
+      e << "The source row stride must be a multiple of the sample size.";
+    }
+    if (hasRegionOfInterest_())
+    {
+      if (roiOrigin_.x >= frameInfo_.width || roiOrigin_.y >= frameInfo_.height)
+      {
+        kdu_core::kdu_error e;
+        e << "The region of interest lies outside the image.";
+      }
+      if (getTargetBytes_() == 0)
+      {
+        kdu_core::kdu_error e;
+        e << "A region of interest needs a target size or bitrate.";
+      }
+    }
+
+    // reserve the encoded buffer once so it doesn't have to keep growing
+    encoded_.reserve((size_t)frameInfo_.width * frameInfo_.height * frameInfo_.componentCount * getBytesPerSample_());
+
+    // The precision and signedness actually coded may be narrower than the
+    // container described by frameInfo_ when automatic precision is enabled
+    FrameInfo codedFrameInfo = frameInfo_;
+    if (dropAlpha_ && frameInfo_.componentCount == 4)
+    {
+      codedFrameInfo.componentCount = 3;
+    }
+    if (isMasked_())
+    {
+      codedFrameInfo.bitsPerSample = (uint8_t)std::max<int>(sourceDescriptor_.bitsStored, 9);
+    }
+    if (autoPrecision_ && frameInfo_.bitsPerSample > 8)
+    {
+      detectPrecision_(codedFrameInfo);
+    }
+
+    // The siz parameters and coding parameter strings only need to be
+    // rebuilt when a setting or the FrameInfo has changed since the last encode.
+    // The codestream built from them is discarded at the same time
+    if (parametersDirty_ || !isSameFrameInfo_(codedFrameInfo, parametersFrameInfo_))
+    {
+      buildParameters_(codedFrameInfo);
+      if (codestream_.exists())
+      {
+        codestream_.destroy();
+      }
+    }
+    const bool tiled = isTiled_();
+    const kdu_core::kdu_long targetBytes = getTargetBytes_();
 
     kdu_core::kdu_compressed_target *compressed_out = nullptr;
     kdu_buffer_target target(encoded_);
     compressed_out  = &target;
-    // kdu_supp::jp2_family_tgt tgt;
-    // tgt.open(&target);
-    // kdu_supp::jp2_target output;
-    // output.open(&tgt);
-    // kdu_supp::jp2_dimensions dims = output.access_dimensions();
-    // dims.init(&siz);
-    // kdu_supp::jp2_colour colr = output.access_colour();
-    // colr.init((frameInfo_.componentCount == 3) ? kdu_supp::JP2_sRGB_SPACE : kdu_supp::JP2_sLUM_SPACE);
-    // output.write_header();
-    // output.open_codestream(true);
-    // compressed_out  = &output;
-
-    kdu_core::kdu_codestream codestream;
-    codestream.create(&siz, compressed_out);
-
-    // Set up any specific coding parameters and finalize them.
+    kdu_supp::jp2_family_tgt tgt;
+    kdu_supp::jp2_target output;
+    const bool useContainer = fileFormat_ != 0;
+    if (useContainer)
+    {
+      tgt.open(&target);
+      output.open(&tgt);
+      compressed_out  = &output;
+    }
+
+    if (codestream_.exists())
+    {
+      // Same geometry and settings as the last frame - restart the existing
+      // codestream so its tile, resolution and code-block structures are
+      // reused rather than torn down and rebuilt
+      codestream_.restart(compressed_out);
+    }
+    else
+    {
+      codestream_.create(siz_.get(), compressed_out);
+
+      // Set up any specific coding parameters and finalize them.
+      for (const std::string &parameter : codingParameters_)
+      {
+        codestream_.access_siz()->parse_string(parameter.c_str());
+      }
+      codestream_.access_siz()->finalize_all(); // Set up coding defaults
+      codestream_.enable_restart();
+    }
+    kdu_core::kdu_codestream &codestream = codestream_;
+
+    if (useContainer)
+    {
+      // The header is written once the codestream parameters are final so
+      // Kakadu can pick the brand and compatibility (JPH for HT codestreams)
+      kdu_supp::jp2_dimensions dims = output.access_dimensions();
+      dims.init(codestream.access_siz());
+      dims.finalize_compatibility(codestream.access_siz());
+      kdu_supp::jp2_colour colr = output.access_colour();
+      colr.init((codedFrameInfo.componentCount >= 3) ? kdu_supp::JP2_sRGB_SPACE : kdu_supp::JP2_sLUM_SPACE);
+      output.write_header();
+      output.open_codestream(true);
+    }
+
+    // Now compress the image in one hit, using `kdu_stripe_compressor'
+    kdu_supp::kdu_stripe_compressor compressor;
+    kdu_supp::kdu_thread_env env;
+    kdu_supp::kdu_thread_env *pEnv = nullptr;
+    int tileConcurrency = -1;
+    if (numThreads_ > 0)
+    {
+      env.create();
+      for (size_t i = 0; i < numThreads_; i++)
+      {
+        env.add_thread();
+      }
+
+      // let the stripe compressor work on several tiles at once, growing the
+      // thread pool so each tile in flight has a thread to run on
+      if (tiled)
+      {
+        const int numProcessors = kdu_core::kdu_get_num_processors();
+        for (int i = (int)numThreads_ + 1; i < numProcessors; i++)
+        {
+          env.add_thread();
+        }
+        tileConcurrency = (numProcessors > 1) ? numProcessors : 1;
+      }
+      pEnv = &env;
+    }
+
+    // each quality layer gets half the bytes of the one following it
+    std::vector<kdu_core::kdu_long> layerBytes(targetBytes > 0 ? qualityLayers_ : 0);
+    kdu_core::kdu_long layerTarget = targetBytes;
+    for (size_t i = layerBytes.size(); i > 0; i--, layerTarget /= 2)
+    {
+      layerBytes[i - 1] = layerTarget;
+    }
+
+    try
+    {
+      if (hasRegionOfInterest_())
+      {
+        pushRegionOfInterest_(codestream, codedFrameInfo, layerBytes, pEnv);
+      }
+      else
+      {
+        compressor.start(codestream, (int)layerBytes.size(), layerBytes.empty() ? nullptr : layerBytes.data(), nullptr, 0U, false, false, true, 0.0, 0, true, pEnv, nullptr, -1, tileConcurrency);
+        pushSource_(compressor, codedFrameInfo);
+        compressor.finish();
+      }
+    }
+    catch (...)
+    {
+      // stop the worker threads before the codestream they use is destroyed
+      if (pEnv != nullptr)
+      {
+        env.handle_exception(-1);
+        env.destroy();
+      }
+      throw;
+    }
+    const kdu_core::kdu_long codestreamBytes = codestream.get_total_bytes();
+    const kdu_core::kdu_long headerBytes = codestreamBytes - codestream.get_total_bytes(true);
+
+    // Finally, cleanup.  The codestream is kept for the next frame but must
+    // be detached from the thread pool that is about to go away
+    if (pEnv != nullptr)
+    {
+      env.cs_terminate(codestream);
+      env.destroy();
+    }
+
+    if (useContainer)
+    {
+      output.close();
+      tgt.close();
+    }
+    target.close();
+
+    if (useContainer && codestreamIndex_)
+    {
+      insertCodestreamIndex_();
+    }
+
+    statistics_ = EncodeStatistics();
+    statistics_.compressedBytes = encoded_.size();
+    statistics_.headerBytes = (size_t)headerBytes;
+    statistics_.bitsPerPixel = (double)encoded_.size() * 8.0 / ((double)frameInfo_.width * (double)frameInfo_.height);
+#ifndef KAKADUJS_ENCODE_ONLY
+    if (distortionStatistics_)
+    {
+      measureDistortion_(codedFrameInfo);
+    }
+#endif
+  }
+
+  /// Called by every setter that changes the cached coding parameters
+  void parametersChanged_()
+  {
+    parametersDirty_ = true;
+    parametersGeneration_++;
+  }
+
+  void copyParameters_(HTJ2KEncoder &other) const
+  {
+    other.decompositions_ = decompositions_;
+    other.lossless_ = lossless_;
+    other.quantizationStep_ = quantizationStep_;
+    other.progressionOrder_ = progressionOrder_;
+    other.blockDimensions_ = blockDimensions_;
+    other.precincts_ = precincts_;
+    other.htEnabled_ = htEnabled_;
+    other.qfactor = qfactor;
+    other.targetSize_ = targetSize_;
+    other.targetBitrate_ = targetBitrate_;
+    other.tlmEnabled_ = tlmEnabled_;
+    other.pltEnabled_ = pltEnabled_;
+    other.tilePartDivision_ = tilePartDivision_;
+    other.tileSize_ = tileSize_;
+    other.qualityLayers_ = qualityLayers_;
+    other.roiOrigin_ = roiOrigin_;
+    other.roiSize_ = roiSize_;
+    other.colorTransform_ = colorTransform_;
+    other.dropAlpha_ = dropAlpha_;
+    other.sourceDescriptor_ = sourceDescriptor_;
+    other.fileFormat_ = fileFormat_;
+    other.codestreamIndex_ = codestreamIndex_;
+    other.autoPrecision_ = autoPrecision_;
+    other.distortionStatistics_ = distortionStatistics_;
+    // workers keep their codestream across batches until a setting changes
+    if (other.copiedGeneration_ != parametersGeneration_)
+    {
+      other.parametersDirty_ = true;
+      other.copiedGeneration_ = parametersGeneration_;
+    }
+  }
+
+  void buildParameters_(const FrameInfo &codedFrameInfo)
+  {
+    siz_.reset(new kdu_core::siz_params());
+    siz_->set(Scomponents, 0, 0, codedFrameInfo.componentCount);
+    siz_->set(Sdims, 0, 0, frameInfo_.height);
+    siz_->set(Sdims, 0, 1, frameInfo_.width);
+    siz_->set(Sprecision, 0, 0, codedFrameInfo.bitsPerSample);
+    siz_->set(Ssigned, 0, 0, codedFrameInfo.isSigned);
+    if (isTiled_())
+    {
+      siz_->set(Stiles, 0, 0, (int)tileSize_.height);
+      siz_->set(Stiles, 0, 1, (int)tileSize_.width);
+    }
+    kdu_core::kdu_params *siz_ref = siz_.get();
+    siz_ref->finalize();
+
+    codingParameters_.clear();
     if (htEnabled_)
     {
-      codestream.access_siz()->parse_string("Cmodes=HT");
+      codingParameters_.push_back("Cmodes=HT");
+    }
+    // RCT when reversible, ICT otherwise
+    if (codedFrameInfo.componentCount == 3)
+    {
+      codingParameters_.push_back(colorTransform_ ? "Cycc=yes" : "Cycc=no");
     }
     char param[32];
     if (lossless_)
     {
-      codestream.access_siz()->parse_string("Creversible=yes");
+      codingParameters_.push_back("Creversible=yes");
+    }
+    else if (getTargetBytes_() > 0)
+    {
+      // Complexity constrained HT encoding - Kakadu estimates the bit-planes
+      // to code for each block up front so the rate target is met with a
+      // single coding pass instead of a full PCRD multi-pass encode.  Part-1
+      // blocks are fully coded and truncated by PCRD to the layer sizes
+      // passed to the stripe compressor
+      codingParameters_.push_back("Creversible=no");
+      if (htEnabled_)
+      {
+        codingParameters_.push_back("Cplex={6,EST,0.25,-1}");
+      }
     }
     else
     {
-      codestream.access_siz()->parse_string("Creversible=no");
-      snprintf(param,32, "Qfactor=%d", qfactor);
-      codestream.access_siz()->parse_string(param);
+      codingParameters_.push_back("Creversible=no");
+      snprintf(param, 32, "Qfactor=%d", qfactor);
+      codingParameters_.push_back(param);
       // snprintf(param, 32, "Qstep=%f", quantizationStep_);
-      // codestream.access_siz()->parse_string(param);
+      // codingParameters_.push_back(param);
     }
 
     switch (progressionOrder_)
     {
     case 0:
-      codestream.access_siz()->parse_string("Corder=LRCP");
+      codingParameters_.push_back("Corder=LRCP");
       break;
     case 1:
-      codestream.access_siz()->parse_string("Corder=RLCP");
+      codingParameters_.push_back("Corder=RLCP");
       break;
     case 2:
-      codestream.access_siz()->parse_string("Corder=RPCL");
+      codingParameters_.push_back("Corder=RPCL");
       break;
     case 3:
-      codestream.access_siz()->parse_string("Corder=PCRL");
+      codingParameters_.push_back("Corder=PCRL");
       break;
     case 4:
-      codestream.access_siz()->parse_string("Corder=CPRL");
+      codingParameters_.push_back("Corder=CPRL");
       break;
     }
 
-    snprintf(param,32, "Clevels=%zu", decompositions_);
-    codestream.access_siz()->parse_string(param);
+    if (qualityLayers_ > 1)
+    {
+      snprintf(param, 32, "Clayers=%zu", qualityLayers_);
+      codingParameters_.push_back(param);
+    }
+
+    if (hasRegionOfInterest_())
+    {
+      // the mask itself is supplied to the block encoders, see pushRegionOfInterest_()
+      snprintf(param, 32, "Rshift=%d", (int)ROI_SHIFT);
+      codingParameters_.push_back(param);
+    }
 
-    snprintf(param, 32, "Cblk={%d,%d}", blockDimensions_.width, blockDimensions_.height);
-    codestream.access_siz()->parse_string(param);
+    snprintf(param, 32, "Clevels=%zu", decompositions_);
+    codingParameters_.push_back(param);
 
-    codestream.access_siz()->finalize_all(); // Set up coding defaults
+    snprintf(param, 32, "Cblk={%u,%u}", blockDimensions_.height, blockDimensions_.width);
+    codingParameters_.push_back(param);
 
-    // Now compress the image in one hit, using `kdu_stripe_compressor'
-    kdu_supp::kdu_stripe_compressor compressor;
-    kdu_supp::kdu_thread_env env;
-    env.create();
-    env.add_thread();
-    env.add_thread();
-    
-    
-    compressor.start(codestream, 0, nullptr, nullptr, 0U, false, false, true, 0.0, 0, true, &env);
-    
-    // compressor.start(codestream);
-    int stripe_heights[3] = {frameInfo_.height, frameInfo_.height, frameInfo_.height};
-    compressor.push_stripe(buf_, stripe_heights);
-    // if (frameInfo_.bitsPerSample <= 8)
-    // {
-    //   compressor.push_stripe(
-    //       decoded_.data(),
-    //       stripe_heights);
-    // }
-    // else
-    // {
-    //   bool is_signed[3] = {frameInfo_.isSigned, frameInfo_.isSigned, frameInfo_.isSigned};
-    //   int precisions[3] = {frameInfo_.bitsPerSample, frameInfo_.bitsPerSample, frameInfo_.bitsPerSample};
-    //   compressor.push_stripe(
-    //       (kdu_core::kdu_int16 *)decoded_.data(),
-    //       stripe_heights,
-    //       NULL,
-    //       NULL,
-    //       NULL,
-    //       precisions,
-    //       is_signed);
-    // }
-    compressor.finish();
-
-    // Finally, cleanup
-    codestream.destroy();
-
-    // tgt.close();
-    // output.close();
-    target.close();
+    if (precincts_.size() > decompositions_ + 1)
+    {
+      kdu_core::kdu_error e;
+      e << "There are more precinct sizes than resolutions (decompositions + 1).";
+    }
+    for (const Size &precinct : precincts_)
+    {
+      if (!isPowerOfTwo_(precinct.width) || !isPowerOfTwo_(precinct.height))
+      {
+        kdu_core::kdu_error e;
+        e << "Precinct dimensions must be powers of 2.";
+      }
+    }
+    if (!precincts_.empty())
+    {
+      std::string precincts = "Cprecincts=";
+      for (size_t i = 0; i < precincts_.size(); i++)
+      {
+        snprintf(param, 32, "%s{%u,%u}", i ? "," : "", precincts_[i].height, precincts_[i].width);
+        precincts += param;
+      }
+      codingParameters_.push_back("Cuse_precincts=yes");
+      codingParameters_.push_back(precincts);
+    }
+
+    size_t tilePartsPerTile = 1;
+    switch (tilePartDivision_)
+    {
+    case 1:
+      codingParameters_.push_back("ORGtparts=R");
+      tilePartsPerTile = decompositions_ + 1;
+      break;
+    case 2:
+      codingParameters_.push_back("ORGtparts=C");
+      tilePartsPerTile = codedFrameInfo.componentCount;
+      break;
+    case 3:
+      codingParameters_.push_back("ORGtparts=L");
+      tilePartsPerTile = qualityLayers_;
+      break;
+    }
+
+    if (tlmEnabled_)
+    {
+      snprintf(param, 32, "ORGgen_tlm=%zu", tilePartsPerTile);
+      codingParameters_.push_back(param);
+    }
+
+    if (pltEnabled_ || (codestreamIndex_ && fileFormat_ != 0))
+    {
+      codingParameters_.push_back("ORGgen_plt=yes");
+    }
+
+    parametersFrameInfo_ = codedFrameInfo;
+    parametersDirty_ = false;
+  }
+
+#ifndef KAKADUJS_ENCODE_ONLY
+  /// Decodes encoded_ a stripe at a time, comparing each stripe with the
+  /// same rows of the source (see setDistortionStatistics())
+  void measureDistortion_(const FrameInfo &codedFrameInfo)
+  {
+    const int numComponents = codedFrameInfo.componentCount;
+    const int bitsStored = isMasked_() ? sourceDescriptor_.bitsStored : frameInfo_.bitsPerSample;
+    const double peak = (double)((1u << bitsStored) - 1);
+    std::vector<double> sumSquaredError(numComponents, 0.0);
+    std::vector<uint32_t> maximumError(numComponents, 0);
+
+    if (!lossless_)
+    {
+      size_t offset, length;
+      if (!CodestreamIndex::findCodestream(encoded_.data(), encoded_.size(), offset, length))
+      {
+        return;
+      }
+      kdu_core::kdu_compressed_source_buffered input(encoded_.data() + offset, length);
+      kdu_core::kdu_codestream codestream;
+      codestream.create(&input);
+      kdu_supp::kdu_stripe_decompressor decompressor;
+      decompressor.start(codestream);
+
+      const bool planar = sourceDescriptor_.isPlanar;
+      std::vector<int> stripe_heights(numComponents);
+      std::vector<int> sample_offsets(numComponents);
+      std::vector<int> sample_gaps(numComponents, planar ? 1 : numComponents);
+      std::vector<int> row_gaps(numComponents, planar ? frameInfo_.width : frameInfo_.width * numComponents);
+      std::vector<int> precisions(numComponents, codedFrameInfo.bitsPerSample);
+      std::unique_ptr<bool[]> is_signed(new bool[numComponents]);
+      std::fill(is_signed.get(), is_signed.get() + numComponents, codedFrameInfo.isSigned);
+      std::vector<int16_t> reconstructed;
+
+      for (size_t row = 0; row < frameInfo_.height; row += STRIPE_HEIGHT)
+      {
+        const int numRows = (int)std::min<size_t>(STRIPE_HEIGHT, frameInfo_.height - row);
+        normalizeRows_(row, numRows, numComponents);
+        reconstructed.resize(stripe_.size());
+        for (int c = 0; c < numComponents; c++)
+        {
+          stripe_heights[c] = numRows;
+          sample_offsets[c] = planar ? c * numRows * frameInfo_.width : c;
+        }
+        decompressor.pull_stripe(
+            (kdu_core::kdu_int16 *)reconstructed.data(),
+            stripe_heights.data(),
+            sample_offsets.data(),
+            sample_gaps.data(),
+            row_gaps.data(),
+            precisions.data(),
+            is_signed.get());
+
+        const size_t samplesPerPlane = (size_t)numRows * frameInfo_.width;
+        for (size_t i = 0; i < stripe_.size(); i++)
+        {
+          const int c = (int)(planar ? i / samplesPerPlane : i % numComponents);
+          const int32_t error = (int32_t)stripe_[i] - (int32_t)reconstructed[i];
+          const uint32_t absoluteError = (uint32_t)(error < 0 ? -error : error);
+          sumSquaredError[c] += (double)error * (double)error;
+          maximumError[c] = std::max(maximumError[c], absoluteError);
+        }
+      }
+      decompressor.finish();
+      codestream.destroy();
+    }
+
+    const double numSamples = (double)frameInfo_.width * (double)frameInfo_.height;
+    statistics_.components.resize(numComponents);
+    for (int c = 0; c < numComponents; c++)
+    {
+      ComponentStatistics &component = statistics_.components[c];
+      component.meanSquaredError = sumSquaredError[c] / numSamples;
+      component.maximumError = maximumError[c];
+      component.peakSignalToNoiseRatio = component.meanSquaredError > 0.0
+                                             ? 10.0 * std::log10(peak * peak / component.meanSquaredError)
+                                             : std::numeric_limits<double>::infinity();
+    }
+    statistics_.hasDistortion = true;
+  }
+#endif
+
+  /// Inserts the codestream index box just ahead of the jp2c box so clients
+  /// reading the start of the file find it before any compressed data
+  void insertCodestreamIndex_()
+  {
+    size_t offset, length, boxOffset;
+    if (!CodestreamIndex::findCodestream(encoded_.data(), encoded_.size(), offset, length, &boxOffset))
+    {
+      return;
+    }
+    CodestreamIndex index;
+    if (!index.parse(encoded_.data() + offset, length, offset))
+    {
+      return;
+    }
+    std::vector<uint8_t> box;
+    index.writeBox(box, index.getBoxSize());
+    encoded_.insert(encoded_.begin() + boxOffset, box.begin(), box.end());
+  }
+
+  uint8_t *getSource_()
+  {
+    return buf_ ? buf_ : decoded_.data();
+  }
+
+  /// Scans the source samples for their minimum and maximum values and
+  /// narrows the precision and signedness in frameInfo to the smallest that
+  /// holds them.  The precision is kept above 8 bits so decoders continue to
+  /// produce 16 bit samples for 16 bit sources
+  void detectPrecision_(FrameInfo &frameInfo)
+  {
+    int32_t minimum = INT32_MAX;
+    int32_t maximum = INT32_MIN;
+    // only the coded components count, a dropped alpha channel is skipped
+    const size_t numComponents = frameInfo.componentCount;
+    const bool interleavedAlpha = !sourceDescriptor_.isPlanar && numComponents < frameInfo_.componentCount;
+    if (needsNormalization_() || interleavedAlpha)
+    {
+      // scan the normalized samples a stripe at a time
+      for (size_t row = 0; row < frameInfo_.height; row += STRIPE_HEIGHT)
+      {
+        const size_t numRows = std::min<size_t>(STRIPE_HEIGHT, frameInfo_.height - row);
+        normalizeRows_(row, numRows, numComponents);
+        scanSamples_(stripe_.data(), stripe_.size(), minimum, maximum);
+      }
+    }
+    else
+    {
+      const uint8_t *source = getSource_();
+      const size_t numPlanes = sourceDescriptor_.isPlanar ? numComponents : 1;
+      const size_t samplesPerRow = (size_t)frameInfo_.width * (sourceDescriptor_.isPlanar ? 1 : frameInfo_.componentCount);
+      for (size_t plane = 0; plane < numPlanes; plane++)
+      {
+        for (size_t row = 0; row < frameInfo_.height; row++)
+        {
+          const uint8_t *rowStart = source + plane * getPlaneStride_() + row * getRowStride_();
+          scanSamples_((const int16_t *)rowStart, samplesPerRow, minimum, maximum);
+        }
+      }
+    }
+    detectedMinimum_ = minimum;
+    detectedMaximum_ = maximum;
+
+    int precision;
+    if (minimum >= 0)
+    {
+      frameInfo.isSigned = false;
+      precision = bitLength_((uint32_t)maximum);
+    }
+    else
+    {
+      frameInfo.isSigned = true;
+      precision = 1 + std::max(bitLength_((uint32_t)std::max(maximum, 0)), bitLength_((uint32_t)(-(minimum + 1))));
+    }
+    frameInfo.bitsPerSample = (uint8_t)std::min<int>(std::max(precision, 9), frameInfo.bitsPerSample);
+  }
+
+  void scanSamples_(const int16_t *samples, size_t numSamples, int32_t &minimum, int32_t &maximum) const
+  {
+    if (frameInfo_.isSigned)
+    {
+      scanRange_(samples, numSamples, minimum, maximum);
+    }
+    else
+    {
+      scanRange_((const uint16_t *)samples, numSamples, minimum, maximum);
+    }
+  }
+
+  /// Written as a plain reduction with no early exits so the compiler
+  /// vectorizes it (SSE/AVX/NEON natively, SIMD128 under -msimd128)
+  template <typename T>
+  static void scanRange_(const T *samples, size_t numSamples, int32_t &minimum, int32_t &maximum)
+  {
+    if (numSamples == 0)
+    {
+      return;
+    }
+    T lo = samples[0];
+    T hi = samples[0];
+    for (size_t i = 0; i < numSamples; i++)
+    {
+      lo = samples[i] < lo ? samples[i] : lo;
+      hi = samples[i] > hi ? samples[i] : hi;
+    }
+    minimum = std::min<int32_t>(minimum, lo);
+    maximum = std::max<int32_t>(maximum, hi);
+  }
+
+#ifdef __wasm_simd128__
+  /// SIMD128 versions of scanRange_ for the 16 bit cases, eight lanes at a
+  /// time.  The autovectorizer does not reliably turn the generic reduction
+  /// into lane-wise min/max for WASM
+  static void scanRange_(const int16_t *samples, size_t numSamples, int32_t &minimum, int32_t &maximum)
+  {
+    if (numSamples < 8)
+    {
+      scanRange_<int16_t>(samples, numSamples, minimum, maximum);
+      return;
+    }
+    v128_t lo = wasm_v128_load(samples);
+    v128_t hi = lo;
+    size_t i = 8;
+    for (; i + 8 <= numSamples; i += 8)
+    {
+      const v128_t v = wasm_v128_load(samples + i);
+      lo = wasm_i16x8_min(lo, v);
+      hi = wasm_i16x8_max(hi, v);
+    }
+    int16_t los[8], his[8];
+    wasm_v128_store(los, lo);
+    wasm_v128_store(his, hi);
+    scanRange_<int16_t>(los, 8, minimum, maximum);
+    scanRange_<int16_t>(his, 8, minimum, maximum);
+    scanRange_<int16_t>(samples + i, numSamples - i, minimum, maximum);
+  }
+
+  static void scanRange_(const uint16_t *samples, size_t numSamples, int32_t &minimum, int32_t &maximum)
+  {
+    if (numSamples < 8)
+    {
+      scanRange_<uint16_t>(samples, numSamples, minimum, maximum);
+      return;
+    }
+    v128_t lo = wasm_v128_load(samples);
+    v128_t hi = lo;
+    size_t i = 8;
+    for (; i + 8 <= numSamples; i += 8)
+    {
+      const v128_t v = wasm_v128_load(samples + i);
+      lo = wasm_u16x8_min(lo, v);
+      hi = wasm_u16x8_max(hi, v);
+    }
+    uint16_t los[8], his[8];
+    wasm_v128_store(los, lo);
+    wasm_v128_store(his, hi);
+    scanRange_<uint16_t>(los, 8, minimum, maximum);
+    scanRange_<uint16_t>(his, 8, minimum, maximum);
+    scanRange_<uint16_t>(samples + i, numSamples - i, minimum, maximum);
+  }
+#endif
+
+  /// Converts count contiguous 16 bit samples to native endian, keeping the
+  /// stored bits only.  Shifting the high bit up to bit 15 and back down
+  /// again masks and sign extends in one go, which maps directly onto
+  /// SIMD128 lane shifts
+  static void normalizeRow16_(const uint8_t *in, int16_t *out, size_t count, bool bigEndian, int upShift, int downShift, bool isSigned)
+  {
+    size_t i = 0;
+#ifdef __wasm_simd128__
+    for (; i + 8 <= count; i += 8)
+    {
+      v128_t v = wasm_v128_load(in + 2 * i);
+      if (bigEndian)
+      {
+        v = wasm_i8x16_shuffle(v, v, 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+      }
+      v = wasm_i16x8_shl(v, upShift);
+      v = isSigned ? wasm_i16x8_shr(v, downShift) : wasm_u16x8_shr(v, downShift);
+      wasm_v128_store(out + i, v);
+    }
+#endif
+    for (; i < count; i++)
+    {
+      const uint8_t *sample = in + 2 * i;
+      uint16_t value = bigEndian ? (uint16_t)((sample[0] << 8) | sample[1]) : (uint16_t)((sample[1] << 8) | sample[0]);
+      value = (uint16_t)(value << upShift);
+      out[i] = isSigned ? (int16_t)((int16_t)value >> downShift) : (int16_t)(value >> downShift);
+    }
+  }
+
+  size_t getBytesPerSample_() const
+  {
+    return (frameInfo_.bitsPerSample + 8 - 1) / 8;
+  }
+
+  size_t getRowStride_() const
+  {
+    if (sourceDescriptor_.rowStride)
+    {
+      return sourceDescriptor_.rowStride;
+    }
+    return (size_t)frameInfo_.width * (sourceDescriptor_.isPlanar ? 1 : frameInfo_.componentCount) * getBytesPerSample_();
+  }
+
+  size_t getPlaneStride_() const
+  {
+    return getRowStride_() * frameInfo_.height;
+  }
+
+  size_t getSourceSize_() const
+  {
+    return getPlaneStride_() * (sourceDescriptor_.isPlanar ? frameInfo_.componentCount : 1);
+  }
+
+  bool isMasked_() const
+  {
+    return frameInfo_.bitsPerSample > 8 && sourceDescriptor_.bitsStored != 0 &&
+           (sourceDescriptor_.bitsStored < frameInfo_.bitsPerSample ||
+            sourceDescriptor_.highBit != sourceDescriptor_.bitsStored - 1);
+  }
+
+  /// Kakadu takes native endian samples with arbitrary strides directly, only
+  /// byte swapping and bits stored masking need a conversion pass
+  bool needsNormalization_() const
+  {
+    return frameInfo_.bitsPerSample > 8 && (sourceDescriptor_.isBigEndian || isMasked_());
+  }
+
+  /// Converts numRows rows starting at firstRow into stripe_ as native endian
+  /// 16 bit samples holding only the stored bits, sign extended for signed
+  /// data.  8 bit sources are widened.  The first numComponents components are kept in the source layout
+  /// (interleaved or one plane after another)
+  void normalizeRows_(size_t firstRow, size_t numRows, size_t numComponents)
+  {
+    const uint8_t *source = getSource_();
+    const bool planar = sourceDescriptor_.isPlanar;
+    const size_t width = frameInfo_.width;
+    const size_t samplesPerRow = planar ? width : width * frameInfo_.componentCount;
+    stripe_.resize(numRows * width * numComponents);
+
+    const size_t bytesPerSample = getBytesPerSample_();
+    const bool bigEndian = sourceDescriptor_.isBigEndian;
+    const bool masked = isMasked_();
+    const int bitsStored = masked ? sourceDescriptor_.bitsStored : (int)(8 * bytesPerSample);
+    const int shift = masked ? sourceDescriptor_.highBit + 1 - bitsStored : 0;
+    const uint32_t mask = (1u << bitsStored) - 1;
+    const uint32_t signBit = 1u << (bitsStored - 1);
+    const bool isSigned = frameInfo_.isSigned;
+
+    int16_t *out = stripe_.data();
+    const size_t numPlanes = planar ? numComponents : 1;
+    for (size_t plane = 0; plane < numPlanes; plane++)
+    {
+      for (size_t row = firstRow; row < firstRow + numRows; row++)
+      {
+        const uint8_t *in = source + plane * getPlaneStride_() + row * getRowStride_();
+        if (bytesPerSample == 2 && (planar || numComponents == frameInfo_.componentCount))
+        {
+          // every sample in the row is kept
+          normalizeRow16_(in, out, samplesPerRow, bigEndian, 16 - bitsStored - shift, 16 - bitsStored, isSigned);
+          out += samplesPerRow;
+          continue;
+        }
+        for (size_t i = 0; i < samplesPerRow; i++, in += bytesPerSample)
+        {
+          if (!planar && (i % frameInfo_.componentCount) >= numComponents)
+          {
+            continue; // dropped alpha
+          }
+          uint32_t value = (bytesPerSample == 1) ? in[0]
+                           : bigEndian         ? ((uint32_t)in[0] << 8) | in[1]
+                                               : ((uint32_t)in[1] << 8) | in[0];
+          value = (value >> shift) & mask;
+          if (isSigned && (value & signBit))
+          {
+            value -= (mask + 1); // sign extend
+          }
+          *out++ = (int16_t)value;
+        }
+      }
+    }
+  }
+
+  /// Hands the source image to the compressor.  Layouts Kakadu understands
+  /// (strides, planar, interleaved) are described to it directly, otherwise
+  /// the rows are normalized a stripe at a time into a small scratch buffer
+  void pushSource_(kdu_supp::kdu_stripe_compressor &compressor, const FrameInfo &codedFrameInfo)
+  {
+    const int numComponents = codedFrameInfo.componentCount;
+    const int bytesPerSample = (int)getBytesPerSample_();
+    const bool planar = sourceDescriptor_.isPlanar;
+    std::vector<int> stripe_heights(numComponents, frameInfo_.height);
+    std::vector<int> sample_offsets(numComponents);
+    std::vector<int> sample_gaps(numComponents, planar ? 1 : frameInfo_.componentCount);
+    std::vector<int> row_gaps(numComponents);
+    std::vector<int> precisions(numComponents, codedFrameInfo.bitsPerSample);
+    std::unique_ptr<bool[]> is_signed(new bool[numComponents]);
+    std::fill(is_signed.get(), is_signed.get() + numComponents, codedFrameInfo.isSigned);
+
+    if (!needsNormalization_())
+    {
+      // offsets and gaps are measured in samples.  When the alpha channel
+      // is dropped only the first three components are described
+      for (int c = 0; c < numComponents; c++)
+      {
+        sample_offsets[c] = planar ? (int)(c * getPlaneStride_() / bytesPerSample) : c;
+        row_gaps[c] = (int)(getRowStride_() / bytesPerSample);
+      }
+      if (frameInfo_.bitsPerSample <= 8)
+      {
+        compressor.push_stripe(
+            getSource_(),
+            stripe_heights.data(),
+            sample_offsets.data(),
+            sample_gaps.data(),
+            row_gaps.data());
+      }
+      else
+      {
+        compressor.push_stripe(
+            (kdu_core::kdu_int16 *)getSource_(),
+            stripe_heights.data(),
+            sample_offsets.data(),
+            sample_gaps.data(),
+            row_gaps.data(),
+            precisions.data(),
+            is_signed.get());
+      }
+      return;
+    }
+
+    for (size_t row = 0; row < frameInfo_.height; row += STRIPE_HEIGHT)
+    {
+      const int numRows = (int)std::min<size_t>(STRIPE_HEIGHT, frameInfo_.height - row);
+      normalizeRows_(row, numRows, numComponents);
+      for (int c = 0; c < numComponents; c++)
+      {
+        stripe_heights[c] = numRows;
+        sample_offsets[c] = planar ? c * numRows * frameInfo_.width : c;
+        sample_gaps[c] = planar ? 1 : numComponents;
+        row_gaps[c] = planar ? frameInfo_.width : frameInfo_.width * numComponents;
+      }
+      compressor.push_stripe(
+          (kdu_core::kdu_int16 *)stripe_.data(),
+          stripe_heights.data(),
+          sample_offsets.data(),
+          sample_gaps.data(),
+          row_gaps.data(),
+          precisions.data(),
+          is_signed.get());
+    }
+  }
+
+  /// The stripe compressor has no way to hand a kdu_roi_image to the block
+  /// encoders, so region of interest encodes push each tile through its own
+  /// kdu_multi_analysis engine a line at a time and run rate control in
+  /// codestream.flush().  The whole frame is normalized up front so the
+  /// tiles can be visited in any order
+  void pushRegionOfInterest_(kdu_core::kdu_codestream &codestream, const FrameInfo &codedFrameInfo,
+                             std::vector<kdu_core::kdu_long> &layerBytes, kdu_core::kdu_thread_env *pEnv)
+  {
+    const int numComponents = codedFrameInfo.componentCount;
+    const int precision = codedFrameInfo.bitsPerSample;
+    const bool planar = sourceDescriptor_.isPlanar;
+    const size_t width = frameInfo_.width;
+    normalizeRows_(0, frameInfo_.height, numComponents);
+
+    kdu_core::kdu_dims rect;
+    rect.pos = kdu_core::kdu_coords((int)roiOrigin_.x, (int)roiOrigin_.y);
+    rect.size = kdu_core::kdu_coords((int)roiSize_.width, (int)roiSize_.height);
+    kdu_rect_roi roi(rect);
+
+    kdu_core::kdu_dims tiles;
+    codestream.get_valid_tiles(tiles);
+    kdu_core::kdu_coords idx;
+    for (idx.y = 0; idx.y < tiles.size.y; idx.y++)
+    {
+      for (idx.x = 0; idx.x < tiles.size.x; idx.x++)
+      {
+        kdu_core::kdu_tile tile = codestream.open_tile(idx + tiles.pos, pEnv);
+        kdu_core::kdu_multi_analysis engine;
+        engine.create(codestream, tile, pEnv, nullptr, 0, &roi);
+        kdu_core::kdu_dims dims;
+        codestream.get_tile_dims(idx + tiles.pos, -1, dims);
+        for (int y = dims.pos.y; y < dims.pos.y + dims.size.y; y++)
+        {
+          for (int c = 0; c < numComponents; c++)
+          {
+            const int16_t *in = planar ? &stripe_[((size_t)c * frameInfo_.height + y) * width + dims.pos.x]
+                                       : &stripe_[((size_t)y * width + dims.pos.x) * numComponents + c];
+            kdu_core::kdu_line_buf *line = engine.exchange_line(c, nullptr, pEnv);
+            writeLine_(line, in, planar ? 1 : numComponents, precision, codedFrameInfo.isSigned);
+            engine.exchange_line(c, line, pEnv);
+          }
+        }
+        engine.destroy(pEnv);
+        tile.close(pEnv);
+      }
+    }
+    codestream.flush(layerBytes.data(), (int)layerBytes.size(), nullptr, true, true, 0.0, pEnv);
+  }
+
+  /// Converts a row of samples to the representation of the line buffer:
+  /// absolute integers for reversible coding, otherwise normalized to
+  /// [-0.5, 0.5) as floats or as KDU_FIX_POINT fixed point
+  static void writeLine_(kdu_core::kdu_line_buf *line, const int16_t *in, int gap, int precision, bool isSigned)
+  {
+    const int width = line->get_width();
+    const bool absolute = line->is_absolute();
+    const int32_t offset = isSigned ? 0 : 1 << (precision - 1);
+    if (kdu_core::kdu_sample32 *out = line->get_buf32())
+    {
+      const float scale = 1.0f / (float)(1 << precision);
+      for (int x = 0; x < width; x++, in += gap)
+      {
+        const int32_t value = (isSigned ? (int32_t)*in : (int32_t)(uint16_t)*in) - offset;
+        if (absolute)
+        {
+          out[x].ival = value;
+        }
+        else
+        {
+          out[x].fval = (float)value * scale;
+        }
+      }
+      return;
+    }
+    kdu_core::kdu_sample16 *out = line->get_buf16();
+    const int shift = absolute ? 0 : KDU_FIX_POINT - precision;
+    for (int x = 0; x < width; x++, in += gap)
+    {
+      const int32_t value = (isSigned ? (int32_t)*in : (int32_t)(uint16_t)*in) - offset;
+      out[x].ival = (kdu_core::kdu_int16)(shift >= 0 ? value * (1 << shift) : value >> -shift);
+    }
+  }
+
+  static bool isPowerOfTwo_(uint32_t value)
+  {
+    return value != 0 && (value & (value - 1)) == 0;
+  }
+
+  static int bitLength_(uint32_t value)
+  {
+    int bits = 0;
+    while (value)
+    {
+      bits++;
+      value >>= 1;
+    }
+    return bits;
+  }
+
+  static bool isSameFrameInfo_(const FrameInfo &a, const FrameInfo &b)
+  {
+    return a.width == b.width && a.height == b.height && a.bitsPerSample == b.bitsPerSample &&
+           a.componentCount == b.componentCount && a.isSigned == b.isSigned;
+  }
+
+  enum
+  {
+    ROI_SHIFT = 12 // Rshift, above the bit-planes of the default irreversible step size
+  };
+
+  bool hasRegionOfInterest_() const
+  {
+    return roiSize_.width > 0 && roiSize_.height > 0;
+  }
+
+  bool isTiled_() const
+  {
+    return tileSize_.width > 0 && tileSize_.height > 0 &&
+           (tileSize_.width < frameInfo_.width || tileSize_.height < frameInfo_.height);
+  }
+
+  kdu_core::kdu_long getTargetBytes_() const
+  {
+    if (lossless_)
+    {
+      return 0;
+    }
+    if (targetSize_ > 0)
+    {
+      return (kdu_core::kdu_long)targetSize_;
+    }
+    if (targetBitrate_ > 0.0f)
+    {
+      const double pixels = (double)frameInfo_.width * (double)frameInfo_.height;
+      return (kdu_core::kdu_long)(pixels * targetBitrate_ / 8.0);
+    }
+    return 0;
   }
 
-private:
   std::vector<uint8_t> decoded_;
   std::vector<uint8_t> encoded_;
   FrameInfo frameInfo_;
@@ -325,8 +1611,38 @@ private:
   float quantizationStep_;
   size_t progressionOrder_;
   Size blockDimensions_;
+  std::vector<Size> precincts_;
   bool htEnabled_;
   int qfactor;
+  size_t targetSize_;
+  float targetBitrate_;
+  bool tlmEnabled_;
+  bool pltEnabled_;
+  size_t tilePartDivision_;
+  Size tileSize_;
+  size_t qualityLayers_;
+  Point roiOrigin_;
+  Size roiSize_;
+  size_t numThreads_;
+  bool colorTransform_;
+  bool dropAlpha_;
+  SourceDescriptor sourceDescriptor_;
+  std::vector<int16_t> stripe_;
+  size_t fileFormat_;
+  bool codestreamIndex_;
+  bool autoPrecision_;
+  bool distortionStatistics_;
+  EncodeStatistics statistics_;
+  int32_t detectedMinimum_;
+  int32_t detectedMaximum_;
+  bool parametersDirty_;
+  size_t parametersGeneration_; // counts setting changes
+  size_t copiedGeneration_;     // parametersGeneration_ of the master last copied into a batch worker
+  FrameInfo parametersFrameInfo_;
+  std::unique_ptr<kdu_core::siz_params> siz_;
+  std::vector<std::string> codingParameters_;
+  kdu_core::kdu_codestream codestream_;
   uint8_t *buf_;
   size_t size_;
+  std::vector<std::unique_ptr<HTJ2KEncoder>> batchWorkers_;
 };
@@ -0,0 +1,614 @@
+// Copyright (c) Chris Hafey.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+// Kakadu core includes
+#include "kdu_elementary.h"
+#include "kdu_messaging.h"
+#include "kdu_params.h"
+#include "kdu_compressed.h"
+#include "kdu_block_coding.h"
+
+#ifdef __EMSCRIPTEN__
+#include <emscripten/val.h>
+#endif
+#ifdef __wasm_simd128__
+#include <wasm_simd128.h>
+#endif
+
+#include "BufferTarget.hpp"
+#include "CodestreamIndex.hpp"
+#include "Point.hpp"
+#include "Size.hpp"
+
+/// <summary>
+/// JavaScript API for rewriting JPEG 2000 codestreams in the compressed
+/// domain.  By default the code-blocks are copied as they are and only the
+/// packets are rebuilt.  When asked to convert between the Part-1 and the
+/// HT (Part-15) block coders, the work happens one code-block at a time:
+/// every block of the source is decoded to its quantized subband samples
+/// and immediately re-encoded with the other block coder.  The
+/// wavelet transform, quantization and every other coding parameter are
+/// copied unchanged, so no inverse or forward DWT is run and a lossless
+/// source stays bit-exact lossless.  Blocks that already use the requested
+/// coder are copied without decoding.
+///
+/// The same block-level pass can also drop resolution levels, crop to whole
+/// tiles of a tiled image and rotate or flip the image.  Kakadu presents the source with the
+/// requested appearance so each output block maps to one source block, and
+/// reoriented blocks are decoded, reoriented and re-encoded on their own.
+///
+/// Packets are always rebuilt from the blocks, so the progression order,
+/// TLM/PLT markers and tile-part layout of the output can be chosen freely
+/// </summary>
+class HTJ2KTranscoder
+{
+public:
+  /// <summary>
+  /// Constructor for transcoding a JPEG 2000 codestream from JavaScript.
+  /// </summary>
+  HTJ2KTranscoder() : blockCoder_(-1),
+                      discardLevels_(0),
+                      rotation_(0),
+                      flipHorizontal_(false),
+                      flipVertical_(false),
+                      regionOrigin_(0, 0),
+                      regionSize_(0, 0),
+                      progressionOrder_(-1),
+                      tlmEnabled_(false),
+                      pltEnabled_(false),
+                      tilePartDivision_(0)
+  {
+  }
+
+#ifdef __EMSCRIPTEN__
+  /// <summary>
+  /// Resizes the source buffer and returns a TypedArray of the buffer
+  /// allocated in WASM memory space that will hold the JPEG 2000 bitstream
+  /// to transcode.  JavaScript code needs to copy the bitstream into the
+  /// returned TypedArray.
+  /// </summary>
+  emscripten::val getEncodedBuffer(size_t encodedSize)
+  {
+    encoded_.resize(encodedSize);
+    return emscripten::val(emscripten::typed_memory_view(encoded_.size(), encoded_.data()));
+  }
+
+  /// <summary>
+  /// Returns a TypedArray of the buffer allocated in WASM memory space that
+  /// holds the transcoded codestream.
+  /// </summary>
+  emscripten::val getTranscodedBuffer()
+  {
+    return emscripten::val(emscripten::typed_memory_view(transcoded_.size(), transcoded_.data()));
+  }
+#else
+  /// <summary>
+  /// Returns the buffer to store the bitstream to transcode.  This method is
+  /// not exported to JavaScript, it is intended to be called by C++ code
+  /// </summary>
+  std::vector<uint8_t> &getEncodedBytes()
+  {
+    return encoded_;
+  }
+
+  /// <summary>
+  /// Returns the transcoded codestream.  This method is not exported to
+  /// JavaScript, it is intended to be called by C++ code
+  /// </summary>
+  const std::vector<uint8_t> &getTranscodedBytes() const
+  {
+    return transcoded_;
+  }
+#endif
+
+  /// <summary>
+  /// Selects the block coder of the transcoded codestream
+  /// -1 = keep the source coder (default), blocks are only re-packetized
+  /// 0 = Part-1, HT code-blocks are converted
+  /// 1 = HT, Part-1 code-blocks are converted
+  /// </summary>
+  void setBlockCoder(int blockCoder)
+  {
+    blockCoder_ = blockCoder;
+  }
+
+  /// <summary>
+  /// Converts the code-blocks to HT (true) or to the Part-1 block coder
+  /// (false), see setBlockCoder()
+  /// </summary>
+  void setHTEnabled(bool htEnabled)
+  {
+    blockCoder_ = htEnabled ? 1 : 0;
+  }
+
+  /// <summary>
+  /// Sets the number of resolution levels to drop.  Each level halves the
+  /// width and height of the output, e.g. 2 writes a quarter size derivative
+  /// </summary>
+  void setDiscardLevels(size_t discardLevels)
+  {
+    discardLevels_ = discardLevels;
+  }
+
+  /// <summary>
+  /// Sets the clockwise rotation in degrees: 0, 90, 180 or 270
+  /// </summary>
+  void setRotation(size_t rotation)
+  {
+    rotation_ = (rotation / 90) % 4 * 90;
+  }
+
+  /// <summary>
+  /// Mirrors the image horizontally and/or vertically.  Flips are applied
+  /// after the rotation
+  /// </summary>
+  void setFlip(bool flipHorizontal, bool flipVertical)
+  {
+    flipHorizontal_ = flipHorizontal;
+    flipVertical_ = flipVertical;
+  }
+
+  /// <summary>
+  /// Crops the output to the region at origin with the given size, measured
+  /// in the output image (after discarding levels, rotating and flipping).
+  /// Blocks cannot be split, so the region grows to whole tiles.  transcode()
+  /// throws if the region lies outside the image or would not drop a single
+  /// tile (always the case for an untiled image).  An empty size (the
+  /// default) keeps everything
+  /// </summary>
+  void setRegion(Point origin, Size size)
+  {
+    regionOrigin_ = origin;
+    regionSize_ = size;
+  }
+
+  /// <summary>
+  /// Sets the progression order of the output
+  /// -1 = keep the source order (default)
+  /// 0 = LRCP
+  /// 1 = RLCP
+  /// 2 = RPCL
+  /// 3 = PCRL
+  /// 4 = CPRL
+  /// </summary>
+  void setProgressionOrder(int progressionOrder)
+  {
+    progressionOrder_ = progressionOrder;
+  }
+
+  /// <summary>
+  /// Enables writing of tile-part length (TLM) marker segments
+  /// </summary>
+  void setTLMEnabled(bool tlmEnabled)
+  {
+    tlmEnabled_ = tlmEnabled;
+  }
+
+  /// <summary>
+  /// Enables writing of packet length (PLT) marker segments
+  /// </summary>
+  void setPLTEnabled(bool pltEnabled)
+  {
+    pltEnabled_ = pltEnabled;
+  }
+
+  /// <summary>
+  /// Sets how each tile is divided into tile-parts
+  /// 0 = single tile-part per tile
+  /// 1 = one tile-part per resolution
+  /// 2 = one tile-part per component
+  /// </summary>
+  void setTilePartDivision(size_t tilePartDivision)
+  {
+    tilePartDivision_ = tilePartDivision;
+  }
+
+  /// <summary>
+  /// Transcodes the bitstream in the encoded buffer.  The source may be a
+  /// raw codestream or a JP2 family file, the result is a raw codestream
+  /// </summary>
+  void transcode()
+  {
+    size_t offset, length;
+    if (!CodestreamIndex::findCodestream(encoded_.data(), encoded_.size(), offset, length))
+    {
+      kdu_core::kdu_error e;
+      e << "No JPEG 2000 codestream found in the encoded buffer.";
+    }
+
+    kdu_core::kdu_compressed_source_buffered input(encoded_.data() + offset, length);
+    kdu_core::kdu_codestream codestreamIn;
+    codestreamIn.create(&input);
+
+    // Transposition is applied first, then the flips
+    bool transpose = (rotation_ == 90 || rotation_ == 270);
+    bool vflip = (rotation_ == 180 || rotation_ == 270);
+    bool hflip = (rotation_ == 90 || rotation_ == 180);
+    vflip = vflip != flipVertical_;
+    hflip = hflip != flipHorizontal_;
+    const int discardLevels = (int)discardLevels_;
+    codestreamIn.apply_input_restrictions(0, 0, discardLevels, 0, NULL);
+    codestreamIn.change_appearance(transpose, vflip, hflip);
+
+    kdu_buffer_target target(transcoded_);
+    kdu_core::siz_params siz;
+    siz.copy_from(codestreamIn.access_siz(), -1, -1, -1, 0, discardLevels, transpose, vflip, hflip);
+    cropToRegion_(siz, codestreamIn.access_siz());
+    kdu_core::kdu_codestream codestreamOut;
+    codestreamOut.create(&siz, &target);
+    codestreamOut.share_buffering(codestreamIn);
+
+    // copy every marker segment parameter, then switch the block coder
+    kdu_core::siz_params *sizOut = codestreamOut.access_siz();
+    sizOut->copy_all(codestreamIn.access_siz(), 0, discardLevels, transpose, vflip, hflip);
+    setCodingStyle_(sizOut->access_cluster(COD_params));
+    setOrganization_(sizOut);
+    sizOut->finalize_all();
+
+    // Tile indices are absolute on the canvas, which the output shares with
+    // the reoriented source, so a cropped output opens the same indices
+    kdu_core::kdu_dims tilesOut;
+    codestreamOut.get_valid_tiles(tilesOut);
+    kdu_core::kdu_coords idx;
+    for (idx.y = 0; idx.y < tilesOut.size.y; idx.y++)
+    {
+      for (idx.x = 0; idx.x < tilesOut.size.x; idx.x++)
+      {
+        kdu_core::kdu_tile tileIn = codestreamIn.open_tile(idx + tilesOut.pos);
+        kdu_core::kdu_tile tileOut = codestreamOut.open_tile(idx + tilesOut.pos);
+        transcodeTile_(tileIn, tileOut);
+        tileIn.close();
+        tileOut.close();
+      }
+    }
+
+    // Copied blocks keep the quality layers of the source, re-encoded blocks
+    // are written in layer 0 (see transcodeBlock_)
+    codestreamOut.trans_out();
+    codestreamOut.destroy();
+    codestreamIn.destroy();
+    target.close();
+  }
+
+private:
+  /// Shrinks the image area of siz to the tiles intersecting the requested
+  /// region.  The tile grid is untouched, so every remaining tile (and its
+  /// code-blocks) is identical to the source tile.  Dropping tiles renumbers
+  /// the ones that remain, which copy_all() does not do for tile-specific
+  /// marker segments, so such sources are refused
+  void cropToRegion_(kdu_core::siz_params &siz, kdu_core::kdu_params *source)
+  {
+    if (regionSize_.width == 0 || regionSize_.height == 0)
+    {
+      return;
+    }
+    // SIZ attributes hold (y, x) pairs
+    int origin[2], size[2], tileOrigin[2], tileSize[2];
+    const int start[2] = {(int)regionOrigin_.y, (int)regionOrigin_.x};
+    const int extent[2] = {(int)regionSize_.height, (int)regionSize_.width};
+    for (int i = 0; i < 2; i++)
+    {
+      siz.get(Sorigin, 0, i, origin[i]);
+      siz.get(Ssize, 0, i, size[i]);
+      siz.get(Stile_origin, 0, i, tileOrigin[i]);
+      siz.get(Stiles, 0, i, tileSize[i]);
+    }
+    bool tilesDropped = false;
+    for (int i = 0; i < 2; i++)
+    {
+      // region in canvas coordinates, snapped outwards to the tile grid
+      const int first = origin[i] + start[i];
+      const int last = std::min(first + extent[i], size[i]);
+      if (first >= size[i])
+      {
+        kdu_core::kdu_error e;
+        e << "The region to crop lies outside the image.";
+      }
+      const int firstTile = (first - tileOrigin[i]) / tileSize[i];
+      const int lastTile = (last - 1 - tileOrigin[i]) / tileSize[i];
+      tilesDropped = tilesDropped ||
+                     firstTile != (origin[i] - tileOrigin[i]) / tileSize[i] ||
+                     lastTile != (size[i] - 1 - tileOrigin[i]) / tileSize[i];
+      siz.set(Sorigin, 0, i, std::max(origin[i], tileOrigin[i] + firstTile * tileSize[i]));
+      siz.set(Ssize, 0, i, std::min(size[i], tileOrigin[i] + (lastTile + 1) * tileSize[i]));
+    }
+    if (!tilesDropped)
+    {
+      kdu_core::kdu_error e;
+      e << "The region to crop covers every tile of the image; codestreams "
+           "can only be cropped to whole tiles.";
+    }
+    if (hasTileParameters_(source))
+    {
+      kdu_core::kdu_error e;
+      e << "Cannot crop a codestream with tile-specific marker segments.";
+    }
+  }
+
+  /// Returns true if any tile of the codestream carries its own coding
+  /// style (COD/COC), quantization (QCD/QCC), ROI (RGN) or progression (POC)
+  /// parameters rather than inheriting them from the main header
+  static bool hasTileParameters_(kdu_core::kdu_params *siz)
+  {
+    static const char *const attributes[][2] = {
+        {COD_params, Corder}, {COD_params, Clevels}, {COD_params, Cmodes}, {QCD_params, Qguard}, {RGN_params, Rshift}, {POC_params, Porder}};
+    const int numTiles = siz->get_num_tiles();
+    const int numComponents = siz->get_num_comps();
+    for (size_t a = 0; a < sizeof(attributes) / sizeof(attributes[0]); a++)
+    {
+      kdu_core::kdu_params *cluster = siz->access_cluster(attributes[a][0]);
+      for (int t = 0; t < numTiles; t++)
+      {
+        for (int c = -1; c < numComponents; c++)
+        {
+          kdu_core::kdu_params *instance = cluster->access_relation(t, c, 0, true);
+          int value;
+          if (instance != nullptr && instance->get(attributes[a][1], 0, 0, value, false))
+          {
+            return true;
+          }
+        }
+      }
+    }
+    return false;
+  }
+
+  /// Applies the block coder and progression order to the main COD and to
+  /// every tile (COD) and tile-component (COC) instance that copy_all()
+  /// carried over with its own value.  Instances that inherit are left alone
+  /// so no marker segments are added to the tile headers
+  void setCodingStyle_(kdu_core::kdu_params *cod)
+  {
+    const int numTiles = cod->get_num_tiles();
+    const int numComponents = cod->get_num_comps();
+    for (int t = -1; t < numTiles; t++)
+    {
+      for (int c = -1; c < numComponents; c++)
+      {
+        kdu_core::kdu_params *instance = cod->access_relation(t, c, 0, false);
+        if (instance == nullptr)
+        {
+          continue;
+        }
+        const bool main = (t < 0 && c < 0);
+        int modes = 0;
+        if (blockCoder_ >= 0 && (instance->get(Cmodes, 0, 0, modes, false) || main))
+        {
+          modes = (blockCoder_ == 1) ? (modes | Cmodes_HT) : (modes & ~Cmodes_HT);
+          instance->set(Cmodes, 0, 0, modes);
+        }
+        int order = 0;
+        if (progressionOrder_ >= 0 && c < 0 && (instance->get(Corder, 0, 0, order, false) || main))
+        {
+          instance->set(Corder, 0, 0, progressionOrder_);
+        }
+      }
+    }
+  }
+
+  /// Sets the codestream organization (ORG) attributes, which control how
+  /// trans_out() lays out the rebuilt packets
+  void setOrganization_(kdu_core::siz_params *siz)
+  {
+    int tilePartsPerTile = 1;
+    switch (tilePartDivision_)
+    {
+    case 1:
+      siz->parse_string("ORGtparts=R");
+      siz->access_cluster(COD_params)->get(Clevels, 0, 0, tilePartsPerTile);
+      tilePartsPerTile += 1;
+      break;
+    case 2:
+      siz->parse_string("ORGtparts=C");
+      siz->get(Scomponents, 0, 0, tilePartsPerTile);
+      break;
+    }
+
+    char param[32];
+    if (tlmEnabled_)
+    {
+      snprintf(param, 32, "ORGgen_tlm=%d", tilePartsPerTile);
+      siz->parse_string(param);
+    }
+
+    if (pltEnabled_)
+    {
+      siz->parse_string("ORGgen_plt=yes");
+    }
+  }
+
+  void transcodeTile_(kdu_core::kdu_tile tileIn, kdu_core::kdu_tile tileOut)
+  {
+    const int numComponents = tileOut.get_num_components();
+    for (int c = 0; c < numComponents; c++)
+    {
+      kdu_core::kdu_tile_comp compIn = tileIn.access_component(c);
+      kdu_core::kdu_tile_comp compOut = tileOut.access_component(c);
+      const int numResolutions = compOut.get_num_resolutions();
+      for (int r = 0; r < numResolutions; r++)
+      {
+        kdu_core::kdu_resolution resIn = compIn.access_resolution(r);
+        kdu_core::kdu_resolution resOut = compOut.access_resolution(r);
+        int minBand;
+        int numBands = resIn.get_valid_band_indices(minBand);
+        for (int b = minBand; numBands > 0; numBands--, b++)
+        {
+          kdu_core::kdu_subband bandIn = resIn.access_subband(b);
+          kdu_core::kdu_subband bandOut = resOut.access_subband(b);
+          kdu_core::kdu_dims blocksIn, blocksOut;
+          bandIn.get_valid_blocks(blocksIn);
+          bandOut.get_valid_blocks(blocksOut);
+          kdu_core::kdu_coords blockIdx;
+          for (blockIdx.y = 0; blockIdx.y < blocksOut.size.y; blockIdx.y++)
+          {
+            for (blockIdx.x = 0; blockIdx.x < blocksOut.size.x; blockIdx.x++)
+            {
+              kdu_core::kdu_block *in = bandIn.open_block(blockIdx + blocksIn.pos);
+              kdu_core::kdu_block *out = bandOut.open_block(blockIdx + blocksOut.pos);
+              const bool reoriented = in->transpose || in->vflip || in->hflip;
+              if (!reoriented && (in->modes & Cmodes_HT) == (out->modes & Cmodes_HT))
+              {
+                copyBlock_(in, out);
+              }
+              else
+              {
+                transcodeBlock_(in, out, bandOut);
+              }
+              bandIn.close_block(in);
+              bandOut.close_block(out);
+            }
+          }
+        }
+      }
+    }
+  }
+
+  /// Copies the coding passes of a block that already uses the output coder
+  static void copyBlock_(kdu_core::kdu_block *in, kdu_core::kdu_block *out)
+  {
+    out->missing_msbs = in->missing_msbs;
+    out->set_max_passes(in->num_passes, false);
+    out->num_passes = in->num_passes;
+    int numBytes = 0;
+    for (int z = 0; z < in->num_passes; z++)
+    {
+      numBytes += (out->pass_lengths[z] = in->pass_lengths[z]);
+      out->pass_slopes[z] = in->pass_slopes[z];
+    }
+    out->set_max_bytes(numBytes, false);
+    memcpy(out->byte_buffer, in->byte_buffer, numBytes);
+  }
+
+  /// Decodes a block to its quantized samples and re-encodes them with the
+  /// output block coder.  The samples are carried over in the sign-magnitude
+  /// form both coders use, so nothing is requantized.  The decoder produces
+  /// samples in the codestream geometry; the block's appearance flags say how
+  /// to lay them out for the output block
+  void transcodeBlock_(kdu_core::kdu_block *in, kdu_core::kdu_block *out, kdu_core::kdu_subband &bandOut)
+  {
+    out->missing_msbs = in->missing_msbs;
+    out->num_passes = 0;
+    if (in->num_passes == 0)
+    {
+      return; // nothing coded for this block
+    }
+    // the block decoders may write whole groups of 4 rows and columns
+    const int maxSamples = ((in->size.x + 3) & ~3) * ((in->size.y + 3) & ~3);
+    in->set_max_samples(maxSamples);
+    decoder_.decode(in);
+
+    out->set_max_samples(maxSamples);
+    if (!in->transpose && !in->vflip && !in->hflip)
+    {
+      memcpy(out->sample_buffer, in->sample_buffer, in->size.x * in->size.y * sizeof(kdu_core::kdu_int32));
+    }
+    else
+    {
+      reorientSamples_(in, out);
+    }
+
+    // code every remaining bit-plane so the full precision of the source
+    // block is preserved
+    const int numPasses = 3 * (out->K_max_prime - out->missing_msbs) - 2;
+    if (numPasses <= 0)
+    {
+      return;
+    }
+    out->num_passes = numPasses;
+    out->set_max_passes(numPasses, false);
+    encoder_.encode(out, bandOut.get_reversible(), bandOut.get_msb_wmse());
+
+    // trans_out reads the pass slopes as quality layer markers (0xFFFF
+    // less the layer index on a layer's final pass).  The source layering
+    // does not survive the change of coder so everything goes in layer 0
+    for (int z = 0; z < out->num_passes; z++)
+    {
+      out->pass_slopes[z] = (z == out->num_passes - 1) ? 0xFFFF : 0;
+    }
+  }
+
+  /// Lays the decoded samples of in out in the output block geometry.  The
+  /// rows and columns that fill whole groups of 4 go through SIMD128 4x4
+  /// transposes and lane reversals when available, the rest sample by sample
+  static void reorientSamples_(const kdu_core::kdu_block *in, kdu_core::kdu_block *out)
+  {
+    const int width = in->size.x;
+    const int height = in->size.y;
+    const int outWidth = out->size.x;
+    const int outHeight = out->size.y;
+    const kdu_core::kdu_int32 *samples = in->sample_buffer;
+    kdu_core::kdu_int32 *outSamples = out->sample_buffer;
+    int simdWidth = 0, simdHeight = 0;
+#ifdef __wasm_simd128__
+    simdWidth = width & ~3;
+    simdHeight = height & ~3;
+    for (int y = 0; y < simdHeight; y += 4)
+    {
+      for (int x = 0; x < simdWidth; x += 4)
+      {
+        v128_t v[4];
+        for (int i = 0; i < 4; i++)
+        {
+          v[i] = wasm_v128_load(samples + (y + i) * width + x);
+        }
+        if (in->transpose)
+        {
+          // rows of the output are the columns of the input
+          const v128_t t0 = wasm_i32x4_shuffle(v[0], v[1], 0, 4, 1, 5);
+          const v128_t t1 = wasm_i32x4_shuffle(v[2], v[3], 0, 4, 1, 5);
+          const v128_t t2 = wasm_i32x4_shuffle(v[0], v[1], 2, 6, 3, 7);
+          const v128_t t3 = wasm_i32x4_shuffle(v[2], v[3], 2, 6, 3, 7);
+          v[0] = wasm_i32x4_shuffle(t0, t1, 0, 1, 4, 5);
+          v[1] = wasm_i32x4_shuffle(t0, t1, 2, 3, 6, 7);
+          v[2] = wasm_i32x4_shuffle(t2, t3, 0, 1, 4, 5);
+          v[3] = wasm_i32x4_shuffle(t2, t3, 2, 3, 6, 7);
+        }
+        const int groupX = in->transpose ? y : x;
+        const int groupY = in->transpose ? x : y;
+        const int outX = in->hflip ? outWidth - 4 - groupX : groupX;
+        for (int i = 0; i < 4; i++)
+        {
+          const int outY = in->vflip ? outHeight - 1 - (groupY + i) : groupY + i;
+          const v128_t row = in->hflip ? wasm_i32x4_shuffle(v[i], v[i], 3, 2, 1, 0) : v[i];
+          wasm_v128_store(outSamples + outY * outWidth + outX, row);
+        }
+      }
+    }
+#endif
+    for (int y = 0; y < height; y++)
+    {
+      const kdu_core::kdu_int32 *row = samples + y * width;
+      for (int x = (y < simdHeight) ? simdWidth : 0; x < width; x++)
+      {
+        int outX = in->transpose ? y : x;
+        int outY = in->transpose ? x : y;
+        outX = in->hflip ? outWidth - 1 - outX : outX;
+        outY = in->vflip ? outHeight - 1 - outY : outY;
+        outSamples[outY * outWidth + outX] = row[x];
+      }
+    }
+  }
+
+  std::vector<uint8_t> encoded_;
+  std::vector<uint8_t> transcoded_;
+  int blockCoder_;
+  size_t discardLevels_;
+  size_t rotation_;
+  bool flipHorizontal_;
+  bool flipVertical_;
+  Point regionOrigin_;
+  Size regionSize_;
+  int progressionOrder_;
+  bool tlmEnabled_;
+  bool pltEnabled_;
+  size_t tilePartDivision_;
+  kdu_core::kdu_block_decoder decoder_;
+  kdu_core::kdu_block_encoder encoder_;
+};
@@ -0,0 +1,56 @@
+// Copyright (c) Chris Hafey.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include "kdu_elementary.h"
+#include "kdu_roi_processing.h"
+#include <string.h>
+
+/// <summary>
+/// Kakadu ROI mask row source for one tile-component.  Each pull() returns
+/// the next row of the tile, marking the samples inside the rectangle as
+/// foreground
+/// </summary>
+class kdu_rect_roi_node : public kdu_core::kdu_roi_node
+{
+public: // Member functions
+  kdu_rect_roi_node(const kdu_core::kdu_dims &tileRegion, const kdu_core::kdu_dims &rect)
+      : tileRegion_(tileRegion), rect_(rect & tileRegion), row_(tileRegion.pos.y)
+  {
+  }
+  void release() { delete this; }
+  void pull(kdu_core::kdu_byte buf[], int width)
+  {
+    memset(buf, 0, width);
+    if (!rect_.is_empty() && row_ >= rect_.pos.y && row_ < rect_.pos.y + rect_.size.y)
+    {
+      memset(buf + rect_.pos.x - tileRegion_.pos.x, 0xFF, rect_.size.x);
+    }
+    row_++;
+  }
+
+private: // Data
+  kdu_core::kdu_dims tileRegion_;
+  kdu_core::kdu_dims rect_;
+  int row_;
+};
+
+/// <summary>
+/// Kakadu ROI source for a rectangle given in image coordinates.  Every
+/// component shares the same rectangle, so it only suits images without
+/// component subsampling (which is all the encoder produces)
+/// </summary>
+class kdu_rect_roi : public kdu_core::kdu_roi_image
+{
+public: // Member functions
+  kdu_rect_roi(const kdu_core::kdu_dims &rect) : rect_(rect) {}
+  ~kdu_rect_roi() { return; } // Destructor must be virtual
+  kdu_core::kdu_roi_node *acquire_node(int comp_idx, kdu_core::kdu_dims tile_region)
+  {
+    return new kdu_rect_roi_node(tile_region, rect_);
+  }
+
+private: // Data
+  kdu_core::kdu_dims rect_;
+};
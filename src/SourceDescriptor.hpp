@@ -0,0 +1,37 @@
+// Copyright (c) Chris Hafey.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+struct SourceDescriptor {
+    SourceDescriptor() : rowStride(0), isPlanar(false), isBigEndian(false), bitsStored(0), highBit(0) {}
+
+    /// <summary>
+    /// Number of bytes from the start of one row to the start of the next
+    /// row (of one plane when planar).  0 = rows are tightly packed
+    /// </summary>
+    uint32_t rowStride;
+
+    /// <summary>
+    /// true if each component is stored in its own plane (RRR...GGG...BBB...),
+    /// false if components are interleaved (RGBRGB...)
+    /// </summary>
+    bool isPlanar;
+
+    /// <summary>
+    /// true if samples larger than 8 bits are stored most significant byte first
+    /// </summary>
+    bool isBigEndian;
+
+    /// <summary>
+    /// Number of significant bits in each sample (DICOM Bits Stored), range
+    /// [1, bitsPerSample].  0 = bitsPerSample
+    /// </summary>
+    uint8_t bitsStored;
+
+    /// <summary>
+    /// Bit position of the most significant stored bit (DICOM High Bit),
+    /// range [bitsStored - 1, 15].  Ignored when bitsStored is 0
+    /// </summary>
+    uint8_t highBit;
+};
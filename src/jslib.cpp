@@ -1,8 +1,18 @@
 // Copyright (c) Chris Hafey.
 // SPDX-License-Identifier: MIT
 
+// KAKADUJS_DECODE_ONLY / KAKADUJS_ENCODE_ONLY leave out the bindings (and
+// with them the Kakadu code) that a decode-only or encode-only module does
+// not need, see src/CMakeLists.txt
+#ifndef KAKADUJS_ENCODE_ONLY
 #include "HTJ2KDecoder.hpp"
+#endif
+#ifndef KAKADUJS_DECODE_ONLY
 #include "HTJ2KEncoder.hpp"
+#endif
+#if !defined(KAKADUJS_DECODE_ONLY) && !defined(KAKADUJS_ENCODE_ONLY)
+#include "HTJ2KTranscoder.hpp"
+#endif
 
 #include <emscripten.h>
 #include <emscripten/bind.h>
@@ -30,6 +40,18 @@ EMSCRIPTEN_BINDINGS(FrameInfo)
       .field("isSigned", &FrameInfo::isSigned);
 }
 
+#ifndef KAKADUJS_DECODE_ONLY
+EMSCRIPTEN_BINDINGS(SourceDescriptor)
+{
+  value_object<SourceDescriptor>("SourceDescriptor")
+      .field("rowStride", &SourceDescriptor::rowStride)
+      .field("isPlanar", &SourceDescriptor::isPlanar)
+      .field("isBigEndian", &SourceDescriptor::isBigEndian)
+      .field("bitsStored", &SourceDescriptor::bitsStored)
+      .field("highBit", &SourceDescriptor::highBit);
+}
+#endif
+
 EMSCRIPTEN_BINDINGS(Point)
 {
   value_object<Point>("Point")
@@ -42,14 +64,38 @@ EMSCRIPTEN_BINDINGS(Size)
   value_object<Size>("Size")
       .field("width", &Size::width)
       .field("height", &Size::height);
+
+  register_vector<Size>("SizeVector");
+}
+
+#ifndef KAKADUJS_DECODE_ONLY
+EMSCRIPTEN_BINDINGS(EncodeStatistics)
+{
+  value_object<ComponentStatistics>("ComponentStatistics")
+      .field("meanSquaredError", &ComponentStatistics::meanSquaredError)
+      .field("peakSignalToNoiseRatio", &ComponentStatistics::peakSignalToNoiseRatio)
+      .field("maximumError", &ComponentStatistics::maximumError);
+
+  register_vector<ComponentStatistics>("ComponentStatisticsVector");
+
+  value_object<EncodeStatistics>("EncodeStatistics")
+      .field("compressedBytes", &EncodeStatistics::compressedBytes)
+      .field("headerBytes", &EncodeStatistics::headerBytes)
+      .field("bitsPerPixel", &EncodeStatistics::bitsPerPixel)
+      .field("hasDistortion", &EncodeStatistics::hasDistortion)
+      .field("components", &EncodeStatistics::components);
 }
+#endif
 
+#ifndef KAKADUJS_ENCODE_ONLY
 EMSCRIPTEN_BINDINGS(HTJ2KDecoder)
 {
   class_<HTJ2KDecoder>("HTJ2KDecoder")
       .constructor<>()
       .function("getEncodedBuffer", &HTJ2KDecoder::getEncodedBuffer)
       .function("getDecodedBuffer", &HTJ2KDecoder::getDecodedBuffer)
+      .function("getDecodedRegion", &HTJ2KDecoder::getDecodedRegion)
+      .function("reserveBuffers", &HTJ2KDecoder::reserveBuffers)
       .function("readHeader", &HTJ2KDecoder::readHeader)
       .function("calculateSizeAtDecompositionLevel", &HTJ2KDecoder::calculateSizeAtDecompositionLevel)
       .function("decode", &HTJ2KDecoder::decode)
@@ -61,9 +107,16 @@ EMSCRIPTEN_BINDINGS(HTJ2KDecoder)
       .function("getProgressionOrder", &HTJ2KDecoder::getProgressionOrder)
       .function("getBlockDimensions", &HTJ2KDecoder::getBlockDimensions)
       .function("getIsUsingColorTransform", &HTJ2KDecoder::getIsUsingColorTransform)
-      .function("getIsHTEnabled", &HTJ2KDecoder::getIsHTEnabled);
+      .function("getIsHTEnabled", &HTJ2KDecoder::getIsHTEnabled)
+      .function("setNumThreads", &HTJ2KDecoder::setNumThreads)
+      .function("getChunkBuffer", &HTJ2KDecoder::getChunkBuffer)
+      .function("beginProgressive", &HTJ2KDecoder::beginProgressive)
+      .function("setProgressiveStep", &HTJ2KDecoder::setProgressiveStep)
+      .function("decodeProgressive", &HTJ2KDecoder::decodeProgressive);
 }
+#endif
 
+#ifndef KAKADUJS_DECODE_ONLY
 EMSCRIPTEN_BINDINGS(HTJ2KEncoder)
 {
   class_<HTJ2KEncoder>("HTJ2KEncoder")
@@ -73,7 +126,50 @@ EMSCRIPTEN_BINDINGS(HTJ2KEncoder)
       .function("encode", &HTJ2KEncoder::encode)
       .function("setDecompositions", &HTJ2KEncoder::setDecompositions)
       .function("setQuality", &HTJ2KEncoder::setQuality)
+      .function("setTargetSize", &HTJ2KEncoder::setTargetSize)
+      .function("setTargetBitrate", &HTJ2KEncoder::setTargetBitrate)
       .function("setProgressionOrder", &HTJ2KEncoder::setProgressionOrder)
       .function("setBlockDimensions", &HTJ2KEncoder::setBlockDimensions)
-      .function("setHTEnabled", &HTJ2KEncoder::setHTEnabled);
-}
\ No newline at end of file
+      .function("setPrecincts", &HTJ2KEncoder::setPrecincts)
+      .function("setHTEnabled", &HTJ2KEncoder::setHTEnabled)
+      .function("setPreset", &HTJ2KEncoder::setPreset)
+      .function("setNumThreads", &HTJ2KEncoder::setNumThreads)
+      .function("setSourceDescriptor", &HTJ2KEncoder::setSourceDescriptor)
+      .function("setColorTransform", &HTJ2KEncoder::setColorTransform)
+      .function("setDropAlpha", &HTJ2KEncoder::setDropAlpha)
+      .function("setAutoPrecision", &HTJ2KEncoder::setAutoPrecision)
+      .function("getDetectedMinimum", &HTJ2KEncoder::getDetectedMinimum)
+      .function("getDetectedMaximum", &HTJ2KEncoder::getDetectedMaximum)
+      .function("setTileSize", &HTJ2KEncoder::setTileSize)
+      .function("setTLMEnabled", &HTJ2KEncoder::setTLMEnabled)
+      .function("setPLTEnabled", &HTJ2KEncoder::setPLTEnabled)
+      .function("setTilePartDivision", &HTJ2KEncoder::setTilePartDivision)
+      .function("setQualityLayers", &HTJ2KEncoder::setQualityLayers)
+      .function("setRegionOfInterest", &HTJ2KEncoder::setRegionOfInterest)
+      .function("setDistortionStatistics", &HTJ2KEncoder::setDistortionStatistics)
+      .function("getStatistics", &HTJ2KEncoder::getStatistics)
+      .function("setFileFormat", &HTJ2KEncoder::setFileFormat)
+      .function("setCodestreamIndex", &HTJ2KEncoder::setCodestreamIndex);
+}
+#endif
+
+#if !defined(KAKADUJS_DECODE_ONLY) && !defined(KAKADUJS_ENCODE_ONLY)
+EMSCRIPTEN_BINDINGS(HTJ2KTranscoder)
+{
+  class_<HTJ2KTranscoder>("HTJ2KTranscoder")
+      .constructor<>()
+      .function("getEncodedBuffer", &HTJ2KTranscoder::getEncodedBuffer)
+      .function("getTranscodedBuffer", &HTJ2KTranscoder::getTranscodedBuffer)
+      .function("setHTEnabled", &HTJ2KTranscoder::setHTEnabled)
+      .function("setBlockCoder", &HTJ2KTranscoder::setBlockCoder)
+      .function("setDiscardLevels", &HTJ2KTranscoder::setDiscardLevels)
+      .function("setRotation", &HTJ2KTranscoder::setRotation)
+      .function("setFlip", &HTJ2KTranscoder::setFlip)
+      .function("setRegion", &HTJ2KTranscoder::setRegion)
+      .function("setProgressionOrder", &HTJ2KTranscoder::setProgressionOrder)
+      .function("setTLMEnabled", &HTJ2KTranscoder::setTLMEnabled)
+      .function("setPLTEnabled", &HTJ2KTranscoder::setPLTEnabled)
+      .function("setTilePartDivision", &HTJ2KTranscoder::setTilePartDivision)
+      .function("transcode", &HTJ2KTranscoder::transcode);
+}
+#endif
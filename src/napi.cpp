@@ -0,0 +1,1174 @@
+// Copyright (c) Chris Hafey.
+// SPDX-License-Identifier: MIT
+
+// Node-API addon exposing HTJ2KDecoder and HTJ2KEncoder on the native
+// (SIMD accelerated, threaded) Kakadu build.  Setters and getters match
+// jslib.cpp.  The WASM style copy-in/copy-out buffers are replaced by async
+// methods that take a Buffer/TypedArray and resolve to a Buffer:
+//
+//   decoder.decode(encoded)                    -> Promise<Buffer> (pixels)
+//   decoder.decodeSubResolution(encoded, level) -> Promise<Buffer>
+//   decoder.decodeProgressive()                -> Promise<Buffer or null>
+//   encoder.encode(pixels, frameInfo)          -> Promise<Buffer> (codestream)
+//
+// The work runs on the libuv thread pool.  Input is read in place (it is
+// kept alive until the work completes and must not be modified meanwhile)
+// and the result vector becomes the returned Buffer without a copy.  An
+// object runs one job at a time, use several objects for parallel work.
+
+#include "HTJ2KDecoder.hpp"
+#include "HTJ2KEncoder.hpp"
+
+#include <node_api.h>
+#include <functional>
+#include <mutex>
+#include <string>
+
+/* ========================================================================= */
+/*                      Kakadu error and warning messages                    */
+/* ========================================================================= */
+
+// Kakadu reports an error through the installed message object and then
+// throws kdu_exception.  The message may come from one of a decoder's
+// worker threads while the exception surfaces on the thread running the
+// job, so complete messages are published to all threads and numbered.  A
+// failed call rejects with the latest message raised since it started
+// (when several jobs fail at once, that may be another job's message)
+static std::mutex kduErrorMutex;
+static std::string kduErrorText; // latest complete message
+static size_t kduErrorCount = 0; // messages published so far
+
+class kdu_napi_message : public kdu_core::kdu_thread_safe_message
+{
+public:
+  kdu_napi_message(bool collect) : collect_(collect) {}
+  void put_text(const char *string)
+  {
+    // kdu_thread_safe_message keeps messages from several threads apart
+    if (collect_)
+    {
+      pending_ += string;
+    }
+  }
+  void flush(bool end_of_message = false)
+  {
+    if (collect_ && end_of_message)
+    {
+      std::lock_guard<std::mutex> lock(kduErrorMutex);
+      kduErrorText.swap(pending_);
+      pending_.clear();
+      kduErrorCount++;
+    }
+    kdu_thread_safe_message::flush(end_of_message);
+  }
+
+private:
+  bool collect_;
+  std::string pending_;
+};
+
+// Marks the start of a call that may raise a Kakadu error
+static size_t kduErrorMark()
+{
+  std::lock_guard<std::mutex> lock(kduErrorMutex);
+  return kduErrorCount;
+}
+
+// The Kakadu error raised since mark, or fallback if there was none
+static std::string kduErrorSince(size_t mark, const char *fallback)
+{
+  std::lock_guard<std::mutex> lock(kduErrorMutex);
+  return kduErrorCount > mark ? kduErrorText : fallback;
+}
+
+static kdu_napi_message errorMessage(true);
+static kdu_napi_message warningMessage(false); // warnings are dropped
+
+/* ========================================================================= */
+/*                               N-API helpers                               */
+/* ========================================================================= */
+
+#define NAPI_CALL(env, call)         \
+  do                                 \
+  {                                  \
+    if ((call) != napi_ok)           \
+    {                                \
+      throwLastError(env);           \
+      return nullptr;                \
+    }                                \
+  } while (0)
+
+static void throwLastError(napi_env env)
+{
+  bool pending = false;
+  napi_is_exception_pending(env, &pending);
+  if (!pending)
+  {
+    const napi_extended_error_info *info = nullptr;
+    napi_get_last_error_info(env, &info);
+    napi_throw_error(env, nullptr, info && info->error_message ? info->error_message : "kakadujs: N-API call failed");
+  }
+}
+
+// Returns the this object and up to argc arguments, missing ones are undefined
+static bool getArgs(napi_env env, napi_callback_info info, size_t argc, napi_value *argv, napi_value *self)
+{
+  size_t count = argc;
+  return napi_get_cb_info(env, info, &count, argv, self, nullptr) == napi_ok;
+}
+
+static bool getBool(napi_env env, napi_value value, bool &result)
+{
+  return napi_get_value_bool(env, value, &result) == napi_ok;
+}
+
+static bool getUint32(napi_env env, napi_value value, uint32_t &result)
+{
+  return napi_get_value_uint32(env, value, &result) == napi_ok;
+}
+
+static bool getDouble(napi_env env, napi_value value, double &result)
+{
+  return napi_get_value_double(env, value, &result) == napi_ok;
+}
+
+static bool getProperty(napi_env env, napi_value object, const char *name, napi_value &result)
+{
+  return napi_get_named_property(env, object, name, &result) == napi_ok;
+}
+
+static bool getUint32Property(napi_env env, napi_value object, const char *name, uint32_t &result)
+{
+  napi_value value;
+  return getProperty(env, object, name, value) && getUint32(env, value, result);
+}
+
+static bool getBoolProperty(napi_env env, napi_value object, const char *name, bool &result)
+{
+  napi_value value;
+  return getProperty(env, object, name, value) && getBool(env, value, result);
+}
+
+static bool getSize(napi_env env, napi_value value, Size &size)
+{
+  uint32_t width, height;
+  if (!getUint32Property(env, value, "width", width) || !getUint32Property(env, value, "height", height))
+  {
+    return false;
+  }
+  size = Size(width, height);
+  return true;
+}
+
+static bool getPoint(napi_env env, napi_value value, Point &point)
+{
+  uint32_t x, y;
+  if (!getUint32Property(env, value, "x", x) || !getUint32Property(env, value, "y", y))
+  {
+    return false;
+  }
+  point = Point(x, y);
+  return true;
+}
+
+static bool getFrameInfo(napi_env env, napi_value value, FrameInfo &frameInfo)
+{
+  uint32_t width, height, bitsPerSample, componentCount;
+  bool isSigned;
+  if (!getUint32Property(env, value, "width", width) || !getUint32Property(env, value, "height", height) ||
+      !getUint32Property(env, value, "bitsPerSample", bitsPerSample) ||
+      !getUint32Property(env, value, "componentCount", componentCount) ||
+      !getBoolProperty(env, value, "isSigned", isSigned))
+  {
+    return false;
+  }
+  frameInfo.width = (uint16_t)width;
+  frameInfo.height = (uint16_t)height;
+  frameInfo.bitsPerSample = (uint8_t)bitsPerSample;
+  frameInfo.componentCount = (uint8_t)componentCount;
+  frameInfo.isSigned = isSigned;
+  return true;
+}
+
+static bool getSourceDescriptor(napi_env env, napi_value value, SourceDescriptor &sourceDescriptor)
+{
+  uint32_t rowStride, bitsStored, highBit;
+  if (!getUint32Property(env, value, "rowStride", rowStride) ||
+      !getBoolProperty(env, value, "isPlanar", sourceDescriptor.isPlanar) ||
+      !getBoolProperty(env, value, "isBigEndian", sourceDescriptor.isBigEndian) ||
+      !getUint32Property(env, value, "bitsStored", bitsStored) ||
+      !getUint32Property(env, value, "highBit", highBit))
+  {
+    return false;
+  }
+  sourceDescriptor.rowStride = rowStride;
+  sourceDescriptor.bitsStored = (uint8_t)bitsStored;
+  sourceDescriptor.highBit = (uint8_t)highBit;
+  return true;
+}
+
+// Returns the memory of a Buffer, TypedArray, DataView or ArrayBuffer in place
+static bool getBytes(napi_env env, napi_value value, uint8_t *&data, size_t &size)
+{
+  void *raw = nullptr;
+  bool is = false;
+  if (napi_is_typedarray(env, value, &is) == napi_ok && is)
+  {
+    napi_typedarray_type type;
+    size_t length;
+    napi_value arrayBuffer;
+    size_t byteOffset;
+    if (napi_get_typedarray_info(env, value, &type, &length, &raw, &arrayBuffer, &byteOffset) != napi_ok)
+    {
+      return false;
+    }
+    size_t elementSize = 1;
+    switch (type)
+    {
+    case napi_int16_array:
+    case napi_uint16_array:
+      elementSize = 2;
+      break;
+    case napi_int32_array:
+    case napi_uint32_array:
+    case napi_float32_array:
+      elementSize = 4;
+      break;
+    case napi_float64_array:
+    case napi_bigint64_array:
+    case napi_biguint64_array:
+      elementSize = 8;
+      break;
+    default:
+      break;
+    }
+    data = (uint8_t *)raw;
+    size = length * elementSize;
+    return true;
+  }
+  if (napi_is_dataview(env, value, &is) == napi_ok && is)
+  {
+    napi_value arrayBuffer;
+    size_t byteOffset;
+    if (napi_get_dataview_info(env, value, &size, &raw, &arrayBuffer, &byteOffset) != napi_ok)
+    {
+      return false;
+    }
+    data = (uint8_t *)raw;
+    return true;
+  }
+  if (napi_is_arraybuffer(env, value, &is) == napi_ok && is)
+  {
+    if (napi_get_arraybuffer_info(env, value, &raw, &size) != napi_ok)
+    {
+      return false;
+    }
+    data = (uint8_t *)raw;
+    return true;
+  }
+  return false;
+}
+
+// Hands the vector to a Buffer without copying it.  Runtimes that do not
+// allow external buffers (e.g. Electron with the V8 memory cage) get a copy
+static napi_value toBuffer(napi_env env, std::vector<uint8_t> *bytes)
+{
+  napi_value buffer;
+  const napi_status status = napi_create_external_buffer(
+      env, bytes->size(), bytes->data(),
+      [](napi_env, void *, void *hint)
+      { delete (std::vector<uint8_t> *)hint; },
+      bytes, &buffer);
+  if (status == napi_ok)
+  {
+    return buffer;
+  }
+  void *copy;
+  const napi_status copyStatus = napi_create_buffer_copy(env, bytes->size(), bytes->data(), &copy, &buffer);
+  delete bytes;
+  return copyStatus == napi_ok ? buffer : nullptr;
+}
+
+static napi_value createUint32(napi_env env, uint32_t value)
+{
+  napi_value result;
+  return napi_create_uint32(env, value, &result) == napi_ok ? result : nullptr;
+}
+
+static napi_value createInt32(napi_env env, int32_t value)
+{
+  napi_value result;
+  return napi_create_int32(env, value, &result) == napi_ok ? result : nullptr;
+}
+
+static napi_value createDouble(napi_env env, double value)
+{
+  napi_value result;
+  return napi_create_double(env, value, &result) == napi_ok ? result : nullptr;
+}
+
+static napi_value createBool(napi_env env, bool value)
+{
+  napi_value result;
+  return napi_get_boolean(env, value, &result) == napi_ok ? result : nullptr;
+}
+
+static napi_value createObject(napi_env env, const char *const *names, const napi_value *values, size_t count)
+{
+  napi_value object;
+  if (napi_create_object(env, &object) != napi_ok)
+  {
+    return nullptr;
+  }
+  for (size_t i = 0; i < count; i++)
+  {
+    if (values[i] == nullptr || napi_set_named_property(env, object, names[i], values[i]) != napi_ok)
+    {
+      return nullptr;
+    }
+  }
+  return object;
+}
+
+static napi_value createSize(napi_env env, const Size &size)
+{
+  static const char *const names[] = {"width", "height"};
+  const napi_value values[] = {createUint32(env, size.width), createUint32(env, size.height)};
+  return createObject(env, names, values, 2);
+}
+
+static napi_value createPoint(napi_env env, const Point &point)
+{
+  static const char *const names[] = {"x", "y"};
+  const napi_value values[] = {createUint32(env, point.x), createUint32(env, point.y)};
+  return createObject(env, names, values, 2);
+}
+
+static napi_value createFrameInfo(napi_env env, const FrameInfo &frameInfo)
+{
+  static const char *const names[] = {"width", "height", "bitsPerSample", "componentCount", "isSigned"};
+  const napi_value values[] = {createUint32(env, frameInfo.width), createUint32(env, frameInfo.height),
+                               createUint32(env, frameInfo.bitsPerSample), createUint32(env, frameInfo.componentCount),
+                               createBool(env, frameInfo.isSigned)};
+  return createObject(env, names, values, 5);
+}
+
+static napi_value createEncodeStatistics(napi_env env, const EncodeStatistics &statistics)
+{
+  napi_value components;
+  if (napi_create_array_with_length(env, statistics.components.size(), &components) != napi_ok)
+  {
+    return nullptr;
+  }
+  for (size_t i = 0; i < statistics.components.size(); i++)
+  {
+    static const char *const names[] = {"meanSquaredError", "peakSignalToNoiseRatio", "maximumError"};
+    const ComponentStatistics &component = statistics.components[i];
+    const napi_value values[] = {createDouble(env, component.meanSquaredError),
+                                 createDouble(env, component.peakSignalToNoiseRatio),
+                                 createUint32(env, component.maximumError)};
+    napi_value object = createObject(env, names, values, 3);
+    if (object == nullptr || napi_set_element(env, components, (uint32_t)i, object) != napi_ok)
+    {
+      return nullptr;
+    }
+  }
+  static const char *const names[] = {"compressedBytes", "headerBytes", "bitsPerPixel", "hasDistortion", "components"};
+  const napi_value values[] = {createDouble(env, (double)statistics.compressedBytes),
+                               createDouble(env, (double)statistics.headerBytes),
+                               createDouble(env, statistics.bitsPerPixel), createBool(env, statistics.hasDistortion),
+                               components};
+  return createObject(env, names, values, 5);
+}
+
+/* ========================================================================= */
+/*                                 Async jobs                                */
+/* ========================================================================= */
+
+/// <summary>
+/// One async decode or encode.  References to the input and to the wrapping
+/// object keep both alive while the job runs
+/// </summary>
+struct Job
+{
+  Job() : work(nullptr), deferred(nullptr), inputRef(nullptr), selfRef(nullptr), busy(nullptr), input(nullptr), inputSize(0), output(new std::vector<uint8_t>()), hasResult(true) {}
+  ~Job() { delete output; }
+
+  napi_async_work work;
+  napi_deferred deferred;
+  napi_ref inputRef;
+  napi_ref selfRef;
+  bool *busy;
+  uint8_t *input;
+  size_t inputSize;
+  std::vector<uint8_t> *output;
+  bool hasResult; // false resolves to null instead of output
+  std::string error;
+  std::function<void(Job &)> run;
+};
+
+static void executeJob(napi_env, void *data)
+{
+  Job &job = *(Job *)data;
+  const size_t errorMark = kduErrorMark();
+  try
+  {
+    job.run(job);
+  }
+  catch (const std::exception &e)
+  {
+    job.error = e.what();
+  }
+  catch (...)
+  {
+    // kdu_exception - the text went to errorMessage
+    job.error = kduErrorSince(errorMark, "kakadujs: Kakadu error");
+  }
+}
+
+static void completeJob(napi_env env, napi_status status, void *data)
+{
+  Job *job = (Job *)data;
+  *job->busy = false;
+  napi_value result = nullptr;
+  if (status == napi_ok && job->error.empty() && !job->hasResult)
+  {
+    napi_get_null(env, &result);
+  }
+  else if (status == napi_ok && job->error.empty())
+  {
+    result = toBuffer(env, job->output);
+    job->output = nullptr; // owned by the Buffer now
+  }
+  if (result != nullptr)
+  {
+    napi_resolve_deferred(env, job->deferred, result);
+  }
+  else
+  {
+    napi_value message, error;
+    const std::string text = job->error.empty() ? "kakadujs: job failed" : job->error;
+    napi_create_string_utf8(env, text.c_str(), text.size(), &message);
+    napi_create_error(env, nullptr, message, &error);
+    napi_reject_deferred(env, job->deferred, error);
+  }
+  napi_delete_reference(env, job->inputRef);
+  napi_delete_reference(env, job->selfRef);
+  napi_delete_async_work(env, job->work);
+  delete job;
+}
+
+// Queues job on the libuv thread pool and returns its promise
+static napi_value queueJob(napi_env env, Job *job, napi_value self, napi_value input, bool *busy)
+{
+  napi_value promise, name;
+  if (*busy)
+  {
+    delete job;
+    napi_throw_error(env, nullptr, "kakadujs: a job is already running on this object");
+    return nullptr;
+  }
+  job->busy = busy;
+  if (napi_create_promise(env, &job->deferred, &promise) != napi_ok ||
+      napi_create_reference(env, input, 1, &job->inputRef) != napi_ok ||
+      napi_create_reference(env, self, 1, &job->selfRef) != napi_ok ||
+      napi_create_string_utf8(env, "kakadujs", NAPI_AUTO_LENGTH, &name) != napi_ok ||
+      napi_create_async_work(env, nullptr, name, executeJob, completeJob, job, &job->work) != napi_ok ||
+      napi_queue_async_work(env, job->work) != napi_ok)
+  {
+    // the promise is never settled, drop the job
+    if (job->inputRef)
+      napi_delete_reference(env, job->inputRef);
+    if (job->selfRef)
+      napi_delete_reference(env, job->selfRef);
+    if (job->work)
+      napi_delete_async_work(env, job->work);
+    delete job;
+    throwLastError(env);
+    return nullptr;
+  }
+  *busy = true;
+  return promise;
+}
+
+/* ========================================================================= */
+/*                                HTJ2KDecoder                               */
+/* ========================================================================= */
+
+struct DecoderWrap
+{
+  DecoderWrap() : busy(false) {}
+  HTJ2KDecoder decoder;
+  bool busy;
+};
+
+template <typename T>
+static T *unwrap(napi_env env, napi_callback_info info, size_t argc, napi_value *argv, napi_value *self = nullptr)
+{
+  napi_value thisValue;
+  void *wrap = nullptr;
+  if (!getArgs(env, info, argc, argv, &thisValue) || napi_unwrap(env, thisValue, &wrap) != napi_ok)
+  {
+    throwLastError(env);
+    return nullptr;
+  }
+  if (self)
+  {
+    *self = thisValue;
+  }
+  if (((T *)wrap)->busy)
+  {
+    napi_throw_error(env, nullptr, "kakadujs: a job is already running on this object");
+    return nullptr;
+  }
+  return (T *)wrap;
+}
+
+static napi_value decoderConstructor(napi_env env, napi_callback_info info)
+{
+  napi_value self;
+  NAPI_CALL(env, napi_get_cb_info(env, info, nullptr, nullptr, &self, nullptr));
+  DecoderWrap *wrap = new DecoderWrap();
+  if (napi_wrap(env, self, wrap, [](napi_env, void *data, void *)
+                { delete (DecoderWrap *)data; },
+                nullptr, nullptr) != napi_ok)
+  {
+    delete wrap;
+    throwLastError(env);
+    return nullptr;
+  }
+  return self;
+}
+
+enum DecodeMode
+{
+  DecodeFull,
+  DecodeSubResolution,
+  DecodeProgressive
+};
+
+// decode() without an argument and decodeProgressive() decode the chunks
+// appended with appendEncodedBytes()
+static napi_value decodeAsync(napi_env env, napi_callback_info info, DecodeMode mode)
+{
+  napi_value argv[2], self;
+  DecoderWrap *wrap = unwrap<DecoderWrap>(env, info, 2, argv, &self);
+  if (!wrap)
+  {
+    return nullptr;
+  }
+  Job *job = new Job();
+  uint32_t level = 0;
+  napi_valuetype type = napi_undefined;
+  const bool appended = mode == DecodeProgressive ||
+                        (mode == DecodeFull && napi_typeof(env, argv[0], &type) == napi_ok && type == napi_undefined);
+  if ((!appended && !getBytes(env, argv[0], job->input, job->inputSize)) ||
+      (mode == DecodeSubResolution && !getUint32(env, argv[1], level)))
+  {
+    delete job;
+    napi_throw_type_error(env, nullptr, mode == DecodeSubResolution ? "kakadujs: expected (encoded, decompositionLevel)" : "kakadujs: expected a Buffer or TypedArray");
+    return nullptr;
+  }
+  HTJ2KDecoder *decoder = &wrap->decoder;
+  job->run = [decoder, mode, appended, level](Job &job)
+  {
+    if (!appended)
+    {
+      decoder->setEncodedData(job.input, job.inputSize);
+    }
+    decoder->setDecodedBytes(job.output);
+    try
+    {
+      if (mode == DecodeProgressive)
+      {
+        job.hasResult = decoder->decodeProgressive();
+      }
+      else if (mode == DecodeSubResolution)
+      {
+        decoder->decodeSubResolution(level);
+      }
+      else
+      {
+        decoder->decode();
+      }
+    }
+    catch (...)
+    {
+      decoder->setEncodedData(nullptr, 0);
+      decoder->setDecodedBytes(0);
+      throw;
+    }
+    // the Kakadu threads stay with the decoder for its next job, see
+    // decoderReleaseThreads()
+    decoder->setEncodedData(nullptr, 0);
+    decoder->setDecodedBytes(0);
+  };
+  // appended chunks live in the decoder, so the job only holds on to it
+  return queueJob(env, job, self, appended ? self : argv[0], &wrap->busy);
+}
+
+static napi_value decoderDecode(napi_env env, napi_callback_info info)
+{
+  return decodeAsync(env, info, DecodeFull);
+}
+
+static napi_value decoderDecodeSubResolution(napi_env env, napi_callback_info info)
+{
+  return decodeAsync(env, info, DecodeSubResolution);
+}
+
+// decodeProgressive() - resolves to the image the chunks so far allow, or to
+// null when nothing new has arrived, see HTJ2KDecoder::decodeProgressive()
+static napi_value decoderDecodeProgressive(napi_env env, napi_callback_info info)
+{
+  return decodeAsync(env, info, DecodeProgressive);
+}
+
+static napi_value decoderBeginProgressive(napi_env env, napi_callback_info info)
+{
+  DecoderWrap *wrap = unwrap<DecoderWrap>(env, info, 0, nullptr);
+  if (wrap)
+  {
+    wrap->decoder.beginProgressive();
+  }
+  return nullptr;
+}
+
+static napi_value decoderSetProgressiveStep(napi_env env, napi_callback_info info)
+{
+  napi_value argv[1];
+  DecoderWrap *wrap = unwrap<DecoderWrap>(env, info, 1, argv);
+  uint32_t bytes;
+  if (!wrap || !getUint32(env, argv[0], bytes))
+  {
+    return wrap ? (napi_throw_type_error(env, nullptr, "kakadujs: expected a byte count"), nullptr) : nullptr;
+  }
+  wrap->decoder.setProgressiveStep(bytes);
+  return nullptr;
+}
+
+// appendEncodedBytes(chunk) - copies the chunk, it can be reused right away
+static napi_value decoderAppendEncodedBytes(napi_env env, napi_callback_info info)
+{
+  napi_value argv[1];
+  DecoderWrap *wrap = unwrap<DecoderWrap>(env, info, 1, argv);
+  uint8_t *data;
+  size_t size;
+  if (!wrap || !getBytes(env, argv[0], data, size))
+  {
+    return wrap ? (napi_throw_type_error(env, nullptr, "kakadujs: expected a Buffer or TypedArray"), nullptr) : nullptr;
+  }
+  wrap->decoder.appendEncodedBytes(data, size);
+  return nullptr;
+}
+
+// reserveBuffers(encodedCapacity, decodedCapacity) - every decode resolves to
+// a new Buffer, so only the encoded buffer chunks are appended to is reserved
+static napi_value decoderReserveBuffers(napi_env env, napi_callback_info info)
+{
+  napi_value argv[2];
+  DecoderWrap *wrap = unwrap<DecoderWrap>(env, info, 2, argv);
+  uint32_t encodedCapacity, decodedCapacity;
+  if (!wrap || !getUint32(env, argv[0], encodedCapacity) || !getUint32(env, argv[1], decodedCapacity))
+  {
+    return wrap ? (napi_throw_type_error(env, nullptr, "kakadujs: expected (encodedCapacity, decodedCapacity)"), nullptr) : nullptr;
+  }
+  wrap->decoder.reserveBuffers(encodedCapacity, 0);
+  return nullptr;
+}
+
+// readHeader(encoded) - synchronous, the header is small
+static napi_value decoderReadHeader(napi_env env, napi_callback_info info)
+{
+  napi_value argv[1];
+  DecoderWrap *wrap = unwrap<DecoderWrap>(env, info, 1, argv);
+  uint8_t *data;
+  size_t size;
+  if (!wrap)
+  {
+    return nullptr;
+  }
+  if (!getBytes(env, argv[0], data, size))
+  {
+    napi_throw_type_error(env, nullptr, "kakadujs: expected a Buffer or TypedArray");
+    return nullptr;
+  }
+  const size_t errorMark = kduErrorMark();
+  wrap->decoder.setEncodedData(data, size);
+  try
+  {
+    wrap->decoder.readHeader();
+  }
+  catch (...)
+  {
+    wrap->decoder.setEncodedData(nullptr, 0);
+    napi_throw_error(env, nullptr, kduErrorSince(errorMark, "kakadujs: Kakadu error").c_str());
+    return nullptr;
+  }
+  wrap->decoder.setEncodedData(nullptr, 0);
+  return createFrameInfo(env, wrap->decoder.getFrameInfo());
+}
+
+static napi_value decoderGetFrameInfo(napi_env env, napi_callback_info info)
+{
+  DecoderWrap *wrap = unwrap<DecoderWrap>(env, info, 0, nullptr);
+  return wrap ? createFrameInfo(env, wrap->decoder.getFrameInfo()) : nullptr;
+}
+
+static napi_value decoderCalculateSizeAtDecompositionLevel(napi_env env, napi_callback_info info)
+{
+  napi_value argv[1];
+  DecoderWrap *wrap = unwrap<DecoderWrap>(env, info, 1, argv);
+  uint32_t level;
+  if (!wrap || !getUint32(env, argv[0], level))
+  {
+    return wrap ? (napi_throw_type_error(env, nullptr, "kakadujs: expected a decomposition level"), nullptr) : nullptr;
+  }
+  return createSize(env, wrap->decoder.calculateSizeAtDecompositionLevel((int)level));
+}
+
+static napi_value decoderGetDownSample(napi_env env, napi_callback_info info)
+{
+  napi_value argv[1];
+  DecoderWrap *wrap = unwrap<DecoderWrap>(env, info, 1, argv);
+  uint32_t component;
+  if (!wrap || !getUint32(env, argv[0], component))
+  {
+    return wrap ? (napi_throw_type_error(env, nullptr, "kakadujs: expected a component index"), nullptr) : nullptr;
+  }
+  return createPoint(env, wrap->decoder.getDownSample(component));
+}
+
+static napi_value decoderGetNumDecompositions(napi_env env, napi_callback_info info)
+{
+  DecoderWrap *wrap = unwrap<DecoderWrap>(env, info, 0, nullptr);
+  return wrap ? createUint32(env, (uint32_t)wrap->decoder.getNumDecompositions()) : nullptr;
+}
+
+static napi_value decoderGetIsReversible(napi_env env, napi_callback_info info)
+{
+  DecoderWrap *wrap = unwrap<DecoderWrap>(env, info, 0, nullptr);
+  return wrap ? createBool(env, wrap->decoder.getIsReversible()) : nullptr;
+}
+
+static napi_value decoderGetProgressionOrder(napi_env env, napi_callback_info info)
+{
+  DecoderWrap *wrap = unwrap<DecoderWrap>(env, info, 0, nullptr);
+  return wrap ? createUint32(env, (uint32_t)wrap->decoder.getProgressionOrder()) : nullptr;
+}
+
+static napi_value decoderGetBlockDimensions(napi_env env, napi_callback_info info)
+{
+  DecoderWrap *wrap = unwrap<DecoderWrap>(env, info, 0, nullptr);
+  return wrap ? createSize(env, wrap->decoder.getBlockDimensions()) : nullptr;
+}
+
+static napi_value decoderGetIsUsingColorTransform(napi_env env, napi_callback_info info)
+{
+  DecoderWrap *wrap = unwrap<DecoderWrap>(env, info, 0, nullptr);
+  return wrap ? createBool(env, wrap->decoder.getIsUsingColorTransform()) : nullptr;
+}
+
+static napi_value decoderGetIsHTEnabled(napi_env env, napi_callback_info info)
+{
+  DecoderWrap *wrap = unwrap<DecoderWrap>(env, info, 0, nullptr);
+  return wrap ? createBool(env, wrap->decoder.getIsHTEnabled()) : nullptr;
+}
+
+static napi_value decoderSetNumThreads(napi_env env, napi_callback_info info)
+{
+  napi_value argv[1];
+  DecoderWrap *wrap = unwrap<DecoderWrap>(env, info, 1, argv);
+  uint32_t numThreads;
+  if (!wrap || !getUint32(env, argv[0], numThreads))
+  {
+    return wrap ? (napi_throw_type_error(env, nullptr, "kakadujs: expected a thread count"), nullptr) : nullptr;
+  }
+  wrap->decoder.setNumThreads(numThreads);
+  return nullptr;
+}
+
+// releaseThreads() - stops the decoder's Kakadu threads now rather than when
+// the decoder is garbage collected.  The next decode starts them again
+static napi_value decoderReleaseThreads(napi_env env, napi_callback_info info)
+{
+  DecoderWrap *wrap = unwrap<DecoderWrap>(env, info, 0, nullptr);
+  if (wrap)
+  {
+    wrap->decoder.releaseThreads();
+  }
+  return nullptr;
+}
+
+/* ========================================================================= */
+/*                                HTJ2KEncoder                               */
+/* ========================================================================= */
+
+struct EncoderWrap
+{
+  EncoderWrap() : busy(false) {}
+  HTJ2KEncoder encoder;
+  bool busy;
+};
+
+static napi_value encoderConstructor(napi_env env, napi_callback_info info)
+{
+  napi_value self;
+  NAPI_CALL(env, napi_get_cb_info(env, info, nullptr, nullptr, &self, nullptr));
+  EncoderWrap *wrap = new EncoderWrap();
+  if (napi_wrap(env, self, wrap, [](napi_env, void *data, void *)
+                { delete (EncoderWrap *)data; },
+                nullptr, nullptr) != napi_ok)
+  {
+    delete wrap;
+    throwLastError(env);
+    return nullptr;
+  }
+  return self;
+}
+
+// encode(pixels, frameInfo) - pixels are read in place through setSourceImage()
+static napi_value encoderEncode(napi_env env, napi_callback_info info)
+{
+  napi_value argv[2], self;
+  EncoderWrap *wrap = unwrap<EncoderWrap>(env, info, 2, argv, &self);
+  if (!wrap)
+  {
+    return nullptr;
+  }
+  Job *job = new Job();
+  FrameInfo frameInfo;
+  if (!getBytes(env, argv[0], job->input, job->inputSize) || !getFrameInfo(env, argv[1], frameInfo))
+  {
+    delete job;
+    napi_throw_type_error(env, nullptr, "kakadujs: expected (pixels, frameInfo)");
+    return nullptr;
+  }
+  HTJ2KEncoder *encoder = &wrap->encoder;
+  encoder->getDecodedBytes(frameInfo);
+  if (job->inputSize < encoder->getSourceSize())
+  {
+    delete job;
+    napi_throw_type_error(env, nullptr, "kakadujs: pixels is smaller than frameInfo describes");
+    return nullptr;
+  }
+  job->run = [encoder](Job &job)
+  {
+    encoder->setSourceImage(job.input, job.inputSize);
+    try
+    {
+      encoder->encode();
+    }
+    catch (...)
+    {
+      encoder->setSourceImage(nullptr, 0);
+      throw;
+    }
+    encoder->setSourceImage(nullptr, 0);
+    encoder->swapEncodedBytes(*job.output);
+  };
+  return queueJob(env, job, self, argv[0], &wrap->busy);
+}
+
+static napi_value invalidArguments(napi_env env, const char *message)
+{
+  napi_throw_type_error(env, nullptr, message);
+  return nullptr;
+}
+
+static napi_value setBoolOption(napi_env env, napi_callback_info info, void (HTJ2KEncoder::*setter)(bool), const char *message)
+{
+  napi_value argv[1];
+  EncoderWrap *wrap = unwrap<EncoderWrap>(env, info, 1, argv);
+  bool value;
+  if (!wrap)
+  {
+    return nullptr;
+  }
+  if (!getBool(env, argv[0], value))
+  {
+    return invalidArguments(env, message);
+  }
+  (wrap->encoder.*setter)(value);
+  return nullptr;
+}
+
+static napi_value setSizeOption(napi_env env, napi_callback_info info, void (HTJ2KEncoder::*setter)(size_t), const char *message)
+{
+  napi_value argv[1];
+  EncoderWrap *wrap = unwrap<EncoderWrap>(env, info, 1, argv);
+  uint32_t value;
+  if (!wrap)
+  {
+    return nullptr;
+  }
+  if (!getUint32(env, argv[0], value))
+  {
+    return invalidArguments(env, message);
+  }
+  (wrap->encoder.*setter)(value);
+  return nullptr;
+}
+
+static napi_value setDimensionOption(napi_env env, napi_callback_info info, void (HTJ2KEncoder::*setter)(Size), const char *message)
+{
+  napi_value argv[1];
+  EncoderWrap *wrap = unwrap<EncoderWrap>(env, info, 1, argv);
+  Size value;
+  if (!wrap)
+  {
+    return nullptr;
+  }
+  if (!getSize(env, argv[0], value))
+  {
+    return invalidArguments(env, message);
+  }
+  (wrap->encoder.*setter)(value);
+  return nullptr;
+}
+
+#define BOOL_SETTER(name)                                                                     \
+  static napi_value encoder_##name(napi_env env, napi_callback_info info)                    \
+  {                                                                                           \
+    return setBoolOption(env, info, &HTJ2KEncoder::name, "kakadujs: " #name " expects a boolean"); \
+  }
+
+#define SIZE_T_SETTER(name)                                                                  \
+  static napi_value encoder_##name(napi_env env, napi_callback_info info)                   \
+  {                                                                                          \
+    return setSizeOption(env, info, &HTJ2KEncoder::name, "kakadujs: " #name " expects a number"); \
+  }
+
+#define DIMENSION_SETTER(name)                                                                          \
+  static napi_value encoder_##name(napi_env env, napi_callback_info info)                              \
+  {                                                                                                     \
+    return setDimensionOption(env, info, &HTJ2KEncoder::name, "kakadujs: " #name " expects {width, height}"); \
+  }
+
+BOOL_SETTER(setHTEnabled)
+BOOL_SETTER(setColorTransform)
+BOOL_SETTER(setDropAlpha)
+BOOL_SETTER(setAutoPrecision)
+BOOL_SETTER(setTLMEnabled)
+BOOL_SETTER(setPLTEnabled)
+BOOL_SETTER(setDistortionStatistics)
+BOOL_SETTER(setCodestreamIndex)
+SIZE_T_SETTER(setDecompositions)
+SIZE_T_SETTER(setTargetSize)
+SIZE_T_SETTER(setProgressionOrder)
+SIZE_T_SETTER(setNumThreads)
+SIZE_T_SETTER(setTilePartDivision)
+SIZE_T_SETTER(setQualityLayers)
+SIZE_T_SETTER(setFileFormat)
+SIZE_T_SETTER(setPreset)
+DIMENSION_SETTER(setBlockDimensions)
+DIMENSION_SETTER(setTileSize)
+
+static napi_value encoder_setQuality(napi_env env, napi_callback_info info)
+{
+  napi_value argv[2];
+  EncoderWrap *wrap = unwrap<EncoderWrap>(env, info, 2, argv);
+  bool lossless;
+  double quantizationStep;
+  if (!wrap)
+  {
+    return nullptr;
+  }
+  if (!getBool(env, argv[0], lossless) || !getDouble(env, argv[1], quantizationStep))
+  {
+    return invalidArguments(env, "kakadujs: setQuality expects (lossless, quantizationStep)");
+  }
+  wrap->encoder.setQuality(lossless, (float)quantizationStep);
+  return nullptr;
+}
+
+static napi_value encoder_setTargetBitrate(napi_env env, napi_callback_info info)
+{
+  napi_value argv[1];
+  EncoderWrap *wrap = unwrap<EncoderWrap>(env, info, 1, argv);
+  double bitsPerPixel;
+  if (!wrap)
+  {
+    return nullptr;
+  }
+  if (!getDouble(env, argv[0], bitsPerPixel))
+  {
+    return invalidArguments(env, "kakadujs: setTargetBitrate expects a number");
+  }
+  wrap->encoder.setTargetBitrate((float)bitsPerPixel);
+  return nullptr;
+}
+
+static napi_value encoder_setPrecincts(napi_env env, napi_callback_info info)
+{
+  napi_value argv[1];
+  EncoderWrap *wrap = unwrap<EncoderWrap>(env, info, 1, argv);
+  bool isArray = false;
+  uint32_t length = 0;
+  if (!wrap)
+  {
+    return nullptr;
+  }
+  std::vector<Size> precincts;
+  if (napi_is_array(env, argv[0], &isArray) != napi_ok || !isArray || napi_get_array_length(env, argv[0], &length) != napi_ok)
+  {
+    return invalidArguments(env, "kakadujs: setPrecincts expects an array of {width, height}");
+  }
+  for (uint32_t i = 0; i < length; i++)
+  {
+    napi_value element;
+    Size size;
+    if (napi_get_element(env, argv[0], i, &element) != napi_ok || !getSize(env, element, size))
+    {
+      return invalidArguments(env, "kakadujs: setPrecincts expects an array of {width, height}");
+    }
+    precincts.push_back(size);
+  }
+  wrap->encoder.setPrecincts(precincts);
+  return nullptr;
+}
+
+static napi_value encoder_setSourceDescriptor(napi_env env, napi_callback_info info)
+{
+  napi_value argv[1];
+  EncoderWrap *wrap = unwrap<EncoderWrap>(env, info, 1, argv);
+  SourceDescriptor sourceDescriptor;
+  if (!wrap)
+  {
+    return nullptr;
+  }
+  if (!getSourceDescriptor(env, argv[0], sourceDescriptor))
+  {
+    return invalidArguments(env, "kakadujs: setSourceDescriptor expects a SourceDescriptor");
+  }
+  const size_t errorMark = kduErrorMark();
+  try
+  {
+    wrap->encoder.setSourceDescriptor(sourceDescriptor);
+  }
+  catch (...)
+  {
+    napi_throw_range_error(env, nullptr, kduErrorSince(errorMark, "kakadujs: invalid SourceDescriptor").c_str());
+  }
+  return nullptr;
+}
+
+static napi_value encoder_setRegionOfInterest(napi_env env, napi_callback_info info)
+{
+  napi_value argv[2];
+  EncoderWrap *wrap = unwrap<EncoderWrap>(env, info, 2, argv);
+  Point origin;
+  Size size;
+  if (!wrap)
+  {
+    return nullptr;
+  }
+  if (!getPoint(env, argv[0], origin) || !getSize(env, argv[1], size))
+  {
+    return invalidArguments(env, "kakadujs: setRegionOfInterest expects (origin, size)");
+  }
+  wrap->encoder.setRegionOfInterest(origin, size);
+  return nullptr;
+}
+
+static napi_value encoder_getDetectedMinimum(napi_env env, napi_callback_info info)
+{
+  EncoderWrap *wrap = unwrap<EncoderWrap>(env, info, 0, nullptr);
+  return wrap ? createInt32(env, wrap->encoder.getDetectedMinimum()) : nullptr;
+}
+
+static napi_value encoder_getDetectedMaximum(napi_env env, napi_callback_info info)
+{
+  EncoderWrap *wrap = unwrap<EncoderWrap>(env, info, 0, nullptr);
+  return wrap ? createInt32(env, wrap->encoder.getDetectedMaximum()) : nullptr;
+}
+
+static napi_value encoder_getStatistics(napi_env env, napi_callback_info info)
+{
+  EncoderWrap *wrap = unwrap<EncoderWrap>(env, info, 0, nullptr);
+  return wrap ? createEncodeStatistics(env, wrap->encoder.getStatistics()) : nullptr;
+}
+
+/* ========================================================================= */
+/*                                   Module                                  */
+/* ========================================================================= */
+
+static napi_value getVersion(napi_env env, napi_callback_info)
+{
+  napi_value version;
+  NAPI_CALL(env, napi_create_string_utf8(env, KDU_CORE_VERSION, NAPI_AUTO_LENGTH, &version));
+  return version;
+}
+
+#define METHOD(name, function) {name, nullptr, function, nullptr, nullptr, nullptr, napi_default, nullptr}
+#define ENCODER_METHOD(name) METHOD(#name, encoder_##name)
+
+static napi_value init(napi_env env, napi_value exports)
+{
+  kdu_customize_warnings(&warningMessage);
+  kdu_customize_errors(&errorMessage);
+
+  const napi_property_descriptor decoderMethods[] = {
+      METHOD("decode", decoderDecode),
+      METHOD("decodeSubResolution", decoderDecodeSubResolution),
+      METHOD("readHeader", decoderReadHeader),
+      METHOD("getFrameInfo", decoderGetFrameInfo),
+      METHOD("calculateSizeAtDecompositionLevel", decoderCalculateSizeAtDecompositionLevel),
+      METHOD("getDownSample", decoderGetDownSample),
+      METHOD("getNumDecompositions", decoderGetNumDecompositions),
+      METHOD("getIsReversible", decoderGetIsReversible),
+      METHOD("getProgressionOrder", decoderGetProgressionOrder),
+      METHOD("getBlockDimensions", decoderGetBlockDimensions),
+      METHOD("getIsUsingColorTransform", decoderGetIsUsingColorTransform),
+      METHOD("getIsHTEnabled", decoderGetIsHTEnabled),
+      METHOD("setNumThreads", decoderSetNumThreads),
+      METHOD("releaseThreads", decoderReleaseThreads),
+      METHOD("reserveBuffers", decoderReserveBuffers),
+      METHOD("beginProgressive", decoderBeginProgressive),
+      METHOD("setProgressiveStep", decoderSetProgressiveStep),
+      METHOD("appendEncodedBytes", decoderAppendEncodedBytes),
+      METHOD("decodeProgressive", decoderDecodeProgressive),
+  };
+  const napi_property_descriptor encoderMethods[] = {
+      METHOD("encode", encoderEncode),
+      ENCODER_METHOD(setDecompositions),
+      ENCODER_METHOD(setQuality),
+      ENCODER_METHOD(setTargetSize),
+      ENCODER_METHOD(setTargetBitrate),
+      ENCODER_METHOD(setProgressionOrder),
+      ENCODER_METHOD(setBlockDimensions),
+      ENCODER_METHOD(setPrecincts),
+      ENCODER_METHOD(setHTEnabled),
+      ENCODER_METHOD(setPreset),
+      ENCODER_METHOD(setNumThreads),
+      ENCODER_METHOD(setSourceDescriptor),
+      ENCODER_METHOD(setColorTransform),
+      ENCODER_METHOD(setDropAlpha),
+      ENCODER_METHOD(setAutoPrecision),
+      ENCODER_METHOD(getDetectedMinimum),
+      ENCODER_METHOD(getDetectedMaximum),
+      ENCODER_METHOD(setTileSize),
+      ENCODER_METHOD(setTLMEnabled),
+      ENCODER_METHOD(setPLTEnabled),
+      ENCODER_METHOD(setTilePartDivision),
+      ENCODER_METHOD(setQualityLayers),
+      ENCODER_METHOD(setRegionOfInterest),
+      ENCODER_METHOD(setDistortionStatistics),
+      ENCODER_METHOD(getStatistics),
+      ENCODER_METHOD(setFileFormat),
+      ENCODER_METHOD(setCodestreamIndex),
+  };
+
+  napi_value decoderClass, encoderClass, version;
+  NAPI_CALL(env, napi_define_class(env, "HTJ2KDecoder", NAPI_AUTO_LENGTH, decoderConstructor, nullptr,
+                                   sizeof(decoderMethods) / sizeof(decoderMethods[0]), decoderMethods, &decoderClass));
+  NAPI_CALL(env, napi_define_class(env, "HTJ2KEncoder", NAPI_AUTO_LENGTH, encoderConstructor, nullptr,
+                                   sizeof(encoderMethods) / sizeof(encoderMethods[0]), encoderMethods, &encoderClass));
+  NAPI_CALL(env, napi_create_function(env, "getVersion", NAPI_AUTO_LENGTH, getVersion, nullptr, &version));
+  NAPI_CALL(env, napi_set_named_property(env, exports, "HTJ2KDecoder", decoderClass));
+  NAPI_CALL(env, napi_set_named_property(env, exports, "HTJ2KEncoder", encoderClass));
+  NAPI_CALL(env, napi_set_named_property(env, exports, "getVersion", version));
+  return exports;
+}
+
+NAPI_MODULE(NODE_GYP_MODULE_NAME, init)
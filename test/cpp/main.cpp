@@ -6,9 +6,12 @@
 #include <vector>
 #include <iterator>
 #include <time.h>
+#include <string.h>
 #include <algorithm>
+#include <thread>
 #include <HTJ2KDecoder.hpp>
 #include <HTJ2KEncoder.hpp>
+#include <HTJ2KTranscoder.hpp>
 
 /* ========================================================================= */
 /*                         Set up messaging services                         */
@@ -145,6 +148,65 @@ std::vector<uint8_t> decodeFile(const char *path, size_t iterations = 1, bool si
     return decoder.getDecodedBytes();
 }
 
+#ifndef KAKADUJS_ALLOCATOR_NAME
+#define KAKADUJS_ALLOCATOR_NAME "default"
+#endif
+
+// decodes the file on every core at once, each thread with its own decoder.
+// Kakadu allocates per code-block and per tile, so this is where a contended
+// allocator shows up; build with -DKAKADUJS_ALLOCATOR=mimalloc to compare
+void decodeParallelFile(const char *path, size_t iterations = 1, bool silent = false)
+{
+    std::vector<uint8_t> encodedBytes;
+    readFile(path, encodedBytes);
+    const size_t numWorkers = std::max(std::thread::hardware_concurrency(), 1u);
+    const size_t framesPerWorker = std::max(iterations / numWorkers, (size_t)1);
+    FrameInfo frameInfo = {};
+
+    timespec start, finish, delta;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    auto run = [&](size_t workerIndex)
+    {
+        HTJ2KDecoder decoder;
+        decoder.getEncodedBytes() = encodedBytes;
+        for (size_t i = 0; i < framesPerWorker; i++)
+        {
+            decoder.decode();
+        }
+        if (workerIndex == 0)
+        {
+            frameInfo = decoder.getFrameInfo();
+        }
+    };
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < numWorkers; i++)
+    {
+        workers.emplace_back(run, i);
+    }
+    for (std::thread &worker : workers)
+    {
+        worker.join();
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    sub_timespec(start, finish, &delta);
+
+    const size_t frames = framesPerWorker * numWorkers;
+    auto ns = delta.tv_sec * 1000000000.0 + delta.tv_nsec;
+    auto totalTimeMS = ns / 1000000.0;
+    auto timePerFrameMS = ns / 1000000.0 / (double)frames;
+    auto pixels = (frameInfo.width * frameInfo.height);
+    auto megaPixels = (double)pixels / (1024.0 * 1024.0);
+    auto fps = 1000 / timePerFrameMS;
+    auto mps = (double)(megaPixels)*fps;
+
+    if (!silent)
+    {
+        printf("NATIVE decodeParallel %s (%zu threads, %s allocator) TotalTime: %.3f s for %zu frames; TPF=%.3f ms (%.2f MP/s, %.2f FPS)\n", path, numWorkers, KAKADUJS_ALLOCATOR_NAME, totalTimeMS / 1000, frames, timePerFrameMS, mps, fps);
+    }
+}
+
 void encodeFile(const char *inPath, const FrameInfo frameInfo, const char *outPath = NULL, size_t iterations = 1, bool silent = false)
 {
     // printf("FrameInfo %dx%dx%d %d bpp\n", frameInfo.width, frameInfo.height, frameInfo.componentCount, frameInfo.bitsPerSample);
@@ -188,6 +250,627 @@ void encodeFile(const char *inPath, const FrameInfo frameInfo, const char *outPa
     }
 }
 
+void encodeBatchFile(const char *inPath, const FrameInfo frameInfo, size_t frameCount = 1, bool silent = false)
+{
+    HTJ2KEncoder encoder;
+    encoder.setQuality(true, 0.0f);
+    encoder.setDecompositions(5);
+    encoder.setBlockDimensions(Size(64, 64));
+    encoder.setProgressionOrder(0);
+
+    // every frame in the batch points at the same raw image
+    std::vector<uint8_t> rawBytes;
+    readFile(inPath, rawBytes);
+    std::vector<uint8_t *> frames(frameCount, rawBytes.data());
+    std::vector<std::vector<uint8_t>> encoded;
+
+    timespec start, finish, delta;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    encoder.encodeBatch(frames, frameInfo, encoded);
+
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    sub_timespec(start, finish, &delta);
+
+    auto ns = delta.tv_sec * 1000000000.0 + delta.tv_nsec;
+    auto totalTimeMS = ns / 1000000.0;
+    auto timePerFrameMS = ns / 1000000.0 / (double)frameCount;
+    auto pixels = (frameInfo.width * frameInfo.height);
+    auto megaPixels = (double)pixels / (1024.0 * 1024.0);
+    auto fps = 1000 / timePerFrameMS;
+    auto mps = (double)(megaPixels)*fps;
+
+    if (!silent)
+    {
+        printf("NATIVE encodeBatch %s TotalTime: %.3f s for %zu frames; TPF=%.3f ms (%.2f MP/s, %.2f FPS)\n", inPath, totalTimeMS / 1000, frameCount, timePerFrameMS, mps, fps);
+    }
+}
+
+void transcodeFile(const char *inPath, const char *outPath = NULL, size_t iterations = 1, bool silent = false)
+{
+    HTJ2KTranscoder transcoder;
+    transcoder.setHTEnabled(true);
+    readFile(inPath, transcoder.getEncodedBytes());
+
+    timespec start, finish, delta;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (size_t i = 0; i < iterations; i++)
+    {
+        transcoder.transcode();
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    sub_timespec(start, finish, &delta);
+
+    auto ns = delta.tv_sec * 1000000000.0 + delta.tv_nsec;
+    auto totalTimeMS = ns / 1000000.0;
+    auto timePerFrameMS = ns / 1000000.0 / (double)iterations;
+    auto ratio = (double)transcoder.getTranscodedBytes().size() / (double)transcoder.getEncodedBytes().size();
+
+    if (!silent)
+    {
+        printf("NATIVE transcode %s TotalTime: %.3f s for %zu iterations; TPF=%.3f ms size ratio=%.3f\n", inPath, totalTimeMS / 1000, iterations, timePerFrameMS, ratio);
+    }
+
+    if (outPath)
+    {
+        writeFile(outPath, transcoder.getTranscodedBytes());
+    }
+}
+
+// transcodes a lossless codestream to the Part-1 block coder and back to HT
+// and checks that both decode to exactly the pixels of the source
+bool transcodeRoundTrip(const char *path)
+{
+    HTJ2KDecoder decoder;
+    readFile(path, decoder.getEncodedBytes());
+    decoder.decode();
+    const std::vector<uint8_t> expected = decoder.getDecodedBytes();
+
+    HTJ2KTranscoder toPart1;
+    readFile(path, toPart1.getEncodedBytes());
+    toPart1.setHTEnabled(false);
+    toPart1.transcode();
+    decoder.getEncodedBytes() = toPart1.getTranscodedBytes();
+    decoder.decode();
+    const bool part1Matches = decoder.getDecodedBytes() == expected;
+
+    HTJ2KTranscoder toHT;
+    toHT.getEncodedBytes() = toPart1.getTranscodedBytes();
+    toHT.setHTEnabled(true);
+    toHT.transcode();
+    decoder.getEncodedBytes() = toHT.getTranscodedBytes();
+    decoder.decode();
+    const bool htMatches = decoder.getDecodedBytes() == expected;
+
+    printf("NATIVE transcode round trip %s: Part-1 %s, HT %s\n", path, part1Matches ? "bit-exact" : "MISMATCH", htMatches ? "bit-exact" : "MISMATCH");
+    return part1Matches && htMatches;
+}
+
+// encodes a frame twice with one encoder, so the second encode restarts the
+// cached codestream, then once more after a failed encode, and checks both
+// match the output of a freshly built encoder byte for byte
+bool restartRoundTrip(const char *path, const FrameInfo &frameInfo)
+{
+    HTJ2KEncoder fresh;
+    readFile(path, fresh.getDecodedBytes(frameInfo));
+    fresh.encode();
+
+    HTJ2KEncoder restarted;
+    std::vector<uint8_t> &rawBytes = restarted.getDecodedBytes(frameInfo);
+    readFile(path, rawBytes);
+    restarted.encode();
+    restarted.encode();
+    const bool restartMatches = restarted.getEncodedBytes() == fresh.getEncodedBytes();
+
+    restarted.setSourceImage(rawBytes.data(), 1); // too small, encode() fails
+    try
+    {
+        restarted.encode();
+    }
+    catch (...)
+    {
+    }
+    restarted.setSourceImage(nullptr, 0);
+    restarted.encode();
+    const bool recoveryMatches = restarted.getEncodedBytes() == fresh.getEncodedBytes();
+
+    printf("NATIVE encode restart %s: restarted %s, after a failed encode %s\n", path, restartMatches ? "identical" : "MISMATCH", recoveryMatches ? "identical" : "MISMATCH");
+    return restartMatches && recoveryMatches;
+}
+
+// encodes a tiled lossless frame, rotates, flips and crops it with the
+// transcoder and checks it decodes to the same transform of the source
+// pixels.  Cropping an untiled codestream must be refused
+bool transformRoundTrip(const char *path, const FrameInfo &frameInfo)
+{
+    const Size tileSize(128, 128);
+    const size_t rotation = 90;
+    const bool flipVertical = true;
+    const Point regionOrigin(128, 256);
+    const Size regionSize(256, 128);
+
+    HTJ2KEncoder encoder;
+    readFile(path, encoder.getDecodedBytes(frameInfo));
+    encoder.setTileSize(tileSize);
+    encoder.encode();
+
+    HTJ2KDecoder decoder;
+    decoder.getEncodedBytes() = encoder.getEncodedBytes();
+    decoder.decode();
+    const std::vector<uint8_t> source = decoder.getDecodedBytes();
+
+    // rotate clockwise, then flip, then crop the source pixels
+    const size_t bytesPerPixel = (frameInfo.bitsPerSample + 7) / 8 * frameInfo.componentCount;
+    const size_t width = frameInfo.width;
+    const size_t height = frameInfo.height;
+    const size_t rotatedHeight = (rotation == 90 || rotation == 270) ? width : height;
+    std::vector<uint8_t> expected(regionSize.width * regionSize.height * bytesPerPixel);
+    for (size_t y = 0; y < height; y++)
+    {
+        for (size_t x = 0; x < width; x++)
+        {
+            size_t outX = (rotation == 90) ? height - 1 - y : (rotation == 180) ? width - 1 - x : (rotation == 270) ? y : x;
+            size_t outY = (rotation == 90) ? x : (rotation == 180) ? height - 1 - y : (rotation == 270) ? width - 1 - x : y;
+            outY = flipVertical ? rotatedHeight - 1 - outY : outY;
+            if (outX < regionOrigin.x || outX >= regionOrigin.x + regionSize.width ||
+                outY < regionOrigin.y || outY >= regionOrigin.y + regionSize.height)
+            {
+                continue;
+            }
+            memcpy(&expected[((outY - regionOrigin.y) * regionSize.width + outX - regionOrigin.x) * bytesPerPixel],
+                   &source[(y * width + x) * bytesPerPixel], bytesPerPixel);
+        }
+    }
+
+    HTJ2KTranscoder transcoder;
+    transcoder.getEncodedBytes() = encoder.getEncodedBytes();
+    transcoder.setRotation(rotation);
+    transcoder.setFlip(false, flipVertical);
+    transcoder.setRegion(regionOrigin, regionSize);
+    transcoder.transcode();
+    decoder.getEncodedBytes() = transcoder.getTranscodedBytes();
+    decoder.decode();
+    const bool transformMatches = decoder.getFrameInfo().width == regionSize.width &&
+                                  decoder.getFrameInfo().height == regionSize.height &&
+                                  decoder.getDecodedBytes() == expected;
+
+    // a single tile cannot be cropped, transcode() must throw
+    encoder.setTileSize(Size(0, 0));
+    encoder.encode();
+    HTJ2KTranscoder untiled;
+    untiled.getEncodedBytes() = encoder.getEncodedBytes();
+    untiled.setRegion(regionOrigin, regionSize);
+    bool untiledRefused = false;
+    try
+    {
+        untiled.transcode();
+    }
+    catch (...)
+    {
+        untiledRefused = true;
+    }
+
+    printf("NATIVE transcode rotate %zu, flip and crop %s: %s, untiled crop %s\n", rotation, path, transformMatches ? "bit-exact" : "MISMATCH", untiledRefused ? "refused" : "NOT REFUSED");
+    return transformMatches && untiledRefused;
+}
+
+// encodes a signed 16 bit frame losslessly with automatic precision, once as
+// it is and once with its negative samples clamped to 0, and checks both
+// decode to the source samples.  The clamped copy must be coded unsigned
+bool autoPrecisionRoundTrip(const char *path, const FrameInfo &frameInfo)
+{
+    std::vector<uint8_t> source;
+    readFile(path, source);
+    std::vector<uint8_t> clamped = source;
+    int16_t *samples = (int16_t *)clamped.data();
+    for (size_t i = 0; i < clamped.size() / 2; i++)
+    {
+        samples[i] = std::max<int16_t>(samples[i], 0);
+    }
+
+    bool passed = true;
+    const std::vector<uint8_t> *inputs[] = {&source, &clamped};
+    for (const std::vector<uint8_t> *input : inputs)
+    {
+        HTJ2KEncoder encoder;
+        encoder.getDecodedBytes(frameInfo) = *input;
+        encoder.setAutoPrecision(true);
+        encoder.encode();
+
+        HTJ2KDecoder decoder;
+        decoder.getEncodedBytes() = encoder.getEncodedBytes();
+        decoder.decode();
+        const FrameInfo &coded = decoder.getFrameInfo();
+        const bool expectSigned = encoder.getDetectedMinimum() < 0;
+        const bool matches = decoder.getDecodedBytes() == *input;
+        const bool signMatches = coded.isSigned == expectSigned && (input == &source || !coded.isSigned);
+        printf("NATIVE encode auto precision %s%s: coded %s %d bit, %s\n", path, input == &clamped ? " (clamped to unsigned)" : "",
+               coded.isSigned ? "signed" : "unsigned", coded.bitsPerSample, matches && signMatches ? "bit-exact" : "MISMATCH");
+        passed = passed && matches && signMatches;
+    }
+    return passed;
+}
+
+// encodes an interleaved RGB frame losslessly with the reversible colour
+// transform, then again as RGBA with the alpha dropped, and checks both
+// decode to the RGB source
+bool colorTransformRoundTrip(const char *path, const FrameInfo &frameInfo)
+{
+    std::vector<uint8_t> source;
+    readFile(path, source);
+    const size_t pixelCount = (size_t)frameInfo.width * frameInfo.height;
+    std::vector<uint8_t> rgba(pixelCount * 4);
+    for (size_t i = 0; i < pixelCount; i++)
+    {
+        memcpy(&rgba[i * 4], &source[i * 3], 3);
+        rgba[i * 4 + 3] = (uint8_t)i;
+    }
+    FrameInfo rgbaFrameInfo = frameInfo;
+    rgbaFrameInfo.componentCount = 4;
+
+    bool passed = true;
+    for (int dropAlpha = 0; dropAlpha < 2; dropAlpha++)
+    {
+        HTJ2KEncoder encoder;
+        if (dropAlpha)
+        {
+            encoder.getDecodedBytes(rgbaFrameInfo) = rgba;
+            encoder.setDropAlpha(true);
+        }
+        else
+        {
+            encoder.getDecodedBytes(frameInfo) = source;
+        }
+        encoder.setColorTransform(true);
+        encoder.encode();
+
+        HTJ2KDecoder decoder;
+        decoder.getEncodedBytes() = encoder.getEncodedBytes();
+        decoder.decode();
+        const bool matches = decoder.getFrameInfo().componentCount == 3 && decoder.getDecodedBytes() == source;
+        printf("NATIVE encode colour transform %s%s: %s\n", path, dropAlpha ? " (alpha dropped)" : "", matches ? "bit-exact" : "MISMATCH");
+        passed = passed && matches;
+    }
+    return passed;
+}
+
+// encodes a JP2 file with the codestream index box and checks the box just
+// ahead of the jp2c box matches an index built from the codestream as it
+// lies in the file, that its packet lengths cover every tile-part and that
+// the file decodes to the source
+bool jp2RoundTrip(const char *path, const FrameInfo &frameInfo)
+{
+    std::vector<uint8_t> source;
+    readFile(path, source);
+    HTJ2KEncoder encoder;
+    encoder.getDecodedBytes(frameInfo) = source;
+    encoder.setFileFormat(1);
+    encoder.setCodestreamIndex(true);
+    encoder.encode();
+    const std::vector<uint8_t> &encoded = encoder.getEncodedBytes();
+
+    const bool isJP2 = encoded.size() > 12 && memcmp(&encoded[4], "jP  ", 4) == 0;
+    size_t offset = 0, length = 0, boxOffset = 0;
+    CodestreamIndex index;
+    bool indexMatches = CodestreamIndex::findCodestream(encoded.data(), encoded.size(), offset, length, &boxOffset) &&
+                        index.parse(encoded.data() + offset, length, offset);
+    if (indexMatches)
+    {
+        std::vector<uint8_t> box;
+        index.writeBox(box, 0);
+        indexMatches = boxOffset >= box.size() && std::equal(box.begin(), box.end(), encoded.begin() + (boxOffset - box.size()));
+        for (const TilePartIndex &tilePart : index.getTileParts())
+        {
+            uint64_t packetBytes = 0;
+            for (uint32_t packetLength : tilePart.packetLengths)
+            {
+                packetBytes += packetLength;
+            }
+            indexMatches = indexMatches && !tilePart.packetLengths.empty() && tilePart.offset + tilePart.length == tilePart.dataOffset + packetBytes;
+        }
+    }
+
+    HTJ2KDecoder decoder;
+    decoder.getEncodedBytes() = encoded;
+    decoder.decode();
+    const bool matches = decoder.getDecodedBytes() == source;
+    printf("NATIVE encode JP2 %s: %s, index %s, %s\n", path, isJP2 ? "jp2 signature" : "NO jp2 signature",
+           indexMatches ? "matches" : "MISMATCH", matches ? "bit-exact" : "MISMATCH");
+    return isJP2 && indexMatches && matches;
+}
+
+// encodes a tiled codestream with one tile-part per resolution plus TLM and
+// PLT marker segments, then checks the TLM entries in the main header list
+// every tile-part found by CodestreamIndex, that each tile-part carries PLT
+// packet lengths covering its data, and that it decodes to the source
+bool markerSegmentRoundTrip(const char *path, const FrameInfo &frameInfo)
+{
+    std::vector<uint8_t> source;
+    readFile(path, source);
+    HTJ2KEncoder encoder;
+    encoder.getDecodedBytes(frameInfo) = source;
+    encoder.setTileSize({256, 256});
+    encoder.setTilePartDivision(1);
+    encoder.setTLMEnabled(true);
+    encoder.setPLTEnabled(true);
+    encoder.encode();
+    const std::vector<uint8_t> &encoded = encoder.getEncodedBytes();
+
+    CodestreamIndex index;
+    const bool parsed = index.parse(encoded.data(), encoded.size(), 0);
+    const std::vector<TilePartIndex> &tileParts = index.getTileParts();
+
+    // gather the TLM entries, Ttlm and Ptlm sizes come from Stlm
+    std::vector<std::pair<int, uint32_t>> tlm;
+    const size_t mainHeaderEnd = CodestreamIndex::findMainHeaderEnd(encoded.data(), encoded.size());
+    for (size_t pos = 2; pos + 4 <= mainHeaderEnd; pos += 2 + ((encoded[pos + 2] << 8) | encoded[pos + 3]))
+    {
+        if (encoded[pos] != 0xFF || encoded[pos + 1] != 0x55)
+        {
+            continue;
+        }
+        const size_t end = pos + 2 + ((encoded[pos + 2] << 8) | encoded[pos + 3]);
+        const int tileBytes = (encoded[pos + 5] >> 4) & 3;
+        const int lengthBytes = (encoded[pos + 5] & 0x40) ? 4 : 2;
+        for (size_t entry = pos + 6; entry + tileBytes + lengthBytes <= end; entry += tileBytes + lengthBytes)
+        {
+            int tileIndex = tileBytes ? 0 : -1; // no Ttlm means tiles in order
+            uint32_t length = 0;
+            for (int i = 0; i < tileBytes; i++)
+            {
+                tileIndex = (tileIndex << 8) | encoded[entry + i];
+            }
+            for (int i = 0; i < lengthBytes; i++)
+            {
+                length = (length << 8) | encoded[entry + tileBytes + i];
+            }
+            tlm.push_back(std::make_pair(tileIndex, length));
+        }
+    }
+
+    bool tlmMatches = parsed && tileParts.size() == 4 * 6 && tlm.size() == tileParts.size();
+    bool pltMatches = parsed;
+    for (size_t i = 0; i < tileParts.size(); i++)
+    {
+        if (tlmMatches)
+        {
+            tlmMatches = (tlm[i].first < 0 || tlm[i].first == tileParts[i].tileIndex) && tlm[i].second == tileParts[i].length;
+        }
+        uint64_t packetBytes = 0;
+        for (uint32_t packetLength : tileParts[i].packetLengths)
+        {
+            packetBytes += packetLength;
+        }
+        pltMatches = pltMatches && !tileParts[i].packetLengths.empty() && tileParts[i].offset + tileParts[i].length == tileParts[i].dataOffset + packetBytes;
+    }
+
+    HTJ2KDecoder decoder;
+    decoder.getEncodedBytes() = encoded;
+    decoder.decode();
+    const bool matches = decoder.getDecodedBytes() == source;
+    printf("NATIVE encode TLM/PLT %s: %zu tile-parts, TLM %s, PLT %s, %s\n", path, tileParts.size(), tlmMatches ? "matches" : "MISMATCH",
+           pltMatches ? "matches" : "MISMATCH", matches ? "bit-exact" : "MISMATCH");
+    return tlmMatches && pltMatches && matches;
+}
+
+// encodes with tile sizes that do and do not divide the image, checks the
+// codestream has the expected number of tiles and decodes to the source
+bool tiledRoundTrip(const char *path, const FrameInfo &frameInfo)
+{
+    std::vector<uint8_t> source;
+    readFile(path, source);
+    const Size tileSizes[] = {{128, 128}, {200, 136}, {512, 64}};
+    bool passed = true;
+    for (const Size &tileSize : tileSizes)
+    {
+        HTJ2KEncoder encoder;
+        encoder.getDecodedBytes(frameInfo) = source;
+        encoder.setTileSize(tileSize);
+        encoder.encode();
+
+        CodestreamIndex index;
+        index.parse(encoder.getEncodedBytes().data(), encoder.getEncodedBytes().size(), 0);
+        const size_t expectedTiles = ((frameInfo.width + tileSize.width - 1) / tileSize.width) * ((frameInfo.height + tileSize.height - 1) / tileSize.height);
+        const bool tilesMatch = index.getTileParts().size() == expectedTiles;
+
+        HTJ2KDecoder decoder;
+        decoder.getEncodedBytes() = encoder.getEncodedBytes();
+        decoder.decode();
+        const bool matches = decoder.getDecodedBytes() == source;
+        printf("NATIVE encode tiled %ux%u %s: %zu tiles%s, %s\n", tileSize.width, tileSize.height, path, index.getTileParts().size(),
+               tilesMatch ? "" : " (WRONG COUNT)", matches ? "bit-exact" : "MISMATCH");
+        passed = passed && tilesMatch && matches;
+    }
+    return passed;
+}
+
+// squared error of the 16 bit samples inside the rectangle
+double regionSquaredError(const std::vector<uint8_t> &a, const std::vector<uint8_t> &b, size_t width, Point origin, Size size)
+{
+    const int16_t *samplesA = (const int16_t *)a.data();
+    const int16_t *samplesB = (const int16_t *)b.data();
+    double sum = 0.0;
+    for (size_t y = origin.y; y < origin.y + size.height; y++)
+    {
+        for (size_t x = origin.x; x < origin.x + size.width; x++)
+        {
+            const double error = (double)samplesA[y * width + x] - (double)samplesB[y * width + x];
+            sum += error * error;
+        }
+    }
+    return sum;
+}
+
+// encodes an RPCL codestream with one tile-part per resolution and feeds it
+// to a progressive decode in chunks.  Every tile-part must render one image,
+// the first one (lowest resolution only) must be an approximation, and the
+// last image and the final decode() must both be bit-exact
+bool progressiveRoundTrip(const char *path, const FrameInfo &frameInfo)
+{
+    std::vector<uint8_t> source;
+    readFile(path, source);
+    HTJ2KEncoder encoder;
+    encoder.getDecodedBytes(frameInfo) = source;
+    encoder.setProgressionOrder(2);
+    encoder.setTilePartDivision(1);
+    encoder.encode();
+    const std::vector<uint8_t> &encoded = encoder.getEncodedBytes();
+    const size_t tileParts = CodestreamIndex::countCompleteTileParts(encoded.data(), encoded.size());
+
+    // small enough that no chunk completes more than one tile-part
+    const size_t chunkSize = 64;
+    HTJ2KDecoder decoder;
+    decoder.beginProgressive();
+    size_t images = 0;
+    bool firstApproximate = false;
+    bool lastMatches = false;
+    for (size_t offset = 0; offset < encoded.size(); offset += chunkSize)
+    {
+        decoder.appendEncodedBytes(encoded.data() + offset, std::min(chunkSize, encoded.size() - offset));
+        if (decoder.decodeProgressive())
+        {
+            lastMatches = decoder.getDecodedBytes() == source;
+            firstApproximate = firstApproximate || (images == 0 && !lastMatches);
+            images++;
+        }
+    }
+    decoder.decode();
+    const bool matches = decoder.getDecodedBytes() == source;
+    printf("NATIVE progressive decode %s: %zu images for %zu tile-parts%s, last image %s, final %s\n", path, images, tileParts,
+           firstApproximate ? "" : " (FIRST IMAGE EXACT)", lastMatches ? "bit-exact" : "MISMATCH", matches ? "bit-exact" : "MISMATCH");
+    return tileParts == 6 && images == tileParts && firstApproximate && lastMatches && matches;
+}
+
+// encodes a frame to the same target size with and without a region of
+// interest and checks the region comes out closer to the source when it is
+// set.  A region without a target size must be refused
+bool regionOfInterestRoundTrip(const char *path, const FrameInfo &frameInfo)
+{
+    const Point origin(192, 192);
+    const Size size(128, 128);
+    const size_t targetSize = 8192;
+
+    HTJ2KEncoder encoder;
+    std::vector<uint8_t> &rawBytes = encoder.getDecodedBytes(frameInfo);
+    readFile(path, rawBytes);
+    encoder.setQuality(false, 0.0f);
+    encoder.setTargetSize(targetSize);
+    encoder.encode();
+    HTJ2KDecoder decoder;
+    decoder.getEncodedBytes() = encoder.getEncodedBytes();
+    decoder.decode();
+    const double plainError = regionSquaredError(decoder.getDecodedBytes(), rawBytes, frameInfo.width, origin, size);
+
+    encoder.setRegionOfInterest(origin, size);
+    encoder.encode();
+    decoder.getEncodedBytes() = encoder.getEncodedBytes();
+    decoder.decode();
+    const double regionError = regionSquaredError(decoder.getDecodedBytes(), rawBytes, frameInfo.width, origin, size);
+    const size_t regionBytes = encoder.getEncodedBytes().size();
+
+    encoder.setTargetSize(0);
+    bool untargetedRefused = false;
+    try
+    {
+        encoder.encode();
+    }
+    catch (...)
+    {
+        untargetedRefused = true;
+    }
+
+    printf("NATIVE encode region of interest %s: region error %.0f vs %.0f without, %zu bytes, no target %s\n", path, regionError, plainError, regionBytes, untargetedRefused ? "refused" : "NOT REFUSED");
+    return regionError < plainError && regionBytes <= targetSize && untargetedRefused;
+}
+
+void benchmarkPresets(size_t iterations)
+{
+    struct Fixture
+    {
+        const char *path;
+        FrameInfo frameInfo;
+    };
+    const Fixture fixtures[] = {
+        {"test/fixtures/raw/CT1.RAW", {.width = 512, .height = 512, .bitsPerSample = 16, .componentCount = 1, .isSigned = true}},
+        {"test/fixtures/raw/CT2.RAW", {.width = 512, .height = 512, .bitsPerSample = 16, .componentCount = 1, .isSigned = true}},
+        {"test/fixtures/raw/MG1.RAW", {.width = 3064, .height = 4774, .bitsPerSample = 16, .componentCount = 1, .isSigned = false}},
+        {"test/fixtures/raw/MR1.RAW", {.width = 512, .height = 512, .bitsPerSample = 16, .componentCount = 1, .isSigned = true}},
+        {"test/fixtures/raw/MR2.RAW", {.width = 1024, .height = 1024, .bitsPerSample = 16, .componentCount = 1, .isSigned = false}},
+        {"test/fixtures/raw/MR3.RAW", {.width = 512, .height = 512, .bitsPerSample = 16, .componentCount = 1, .isSigned = true}},
+        {"test/fixtures/raw/MR4.RAW", {.width = 512, .height = 512, .bitsPerSample = 16, .componentCount = 1, .isSigned = false}},
+        {"test/fixtures/raw/NM1.RAW", {.width = 256, .height = 1024, .bitsPerSample = 16, .componentCount = 1, .isSigned = true}},
+        {"test/fixtures/raw/RG1.RAW", {.width = 1841, .height = 1955, .bitsPerSample = 16, .componentCount = 1, .isSigned = false}},
+        {"test/fixtures/raw/RG2.RAW", {.width = 1760, .height = 2140, .bitsPerSample = 16, .componentCount = 1, .isSigned = false}},
+        {"test/fixtures/raw/RG3.RAW", {.width = 1760, .height = 1760, .bitsPerSample = 16, .componentCount = 1, .isSigned = false}},
+        {"test/fixtures/raw/SC1.RAW", {.width = 2048, .height = 2487, .bitsPerSample = 16, .componentCount = 1, .isSigned = false}},
+        {"test/fixtures/raw/XA1.RAW", {.width = 1024, .height = 1024, .bitsPerSample = 16, .componentCount = 1, .isSigned = false}},
+    };
+    const char *presetNames[] = {"fastest", "balanced", "smallest"};
+
+    // lossless, lossy at the default Qfactor and lossy at a 1 bit per pixel target
+    struct Mode
+    {
+        const char *name;
+        bool lossless;
+        float targetBitrate;
+    };
+    const Mode modes[] = {{"lossless", true, 0.0f}, {"qfactor", false, 0.0f}, {"1bpp", false, 1.0f}};
+
+    for (const Mode &mode : modes)
+    {
+        for (size_t preset = 0; preset < 3; preset++)
+        {
+            double totalMegaPixels = 0.0;
+            double totalSeconds = 0.0;
+            double totalRawBytes = 0.0;
+            double totalEncodedBytes = 0.0;
+            double totalPSNR = 0.0;
+            for (const Fixture &fixture : fixtures)
+            {
+                HTJ2KEncoder encoder;
+                encoder.setQuality(mode.lossless, 0.0f);
+                encoder.setTargetBitrate(mode.targetBitrate);
+                encoder.setPreset(preset);
+                std::vector<uint8_t> &rawBytes = encoder.getDecodedBytes(fixture.frameInfo);
+                readFile(fixture.path, rawBytes);
+
+                timespec start, finish, delta;
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                for (size_t i = 0; i < iterations; i++)
+                {
+                    encoder.encode();
+                }
+                clock_gettime(CLOCK_MONOTONIC, &finish);
+                sub_timespec(start, finish, &delta);
+
+                // one more encode outside the timing for the distortion
+                double psnr = std::numeric_limits<double>::infinity();
+                if (!mode.lossless)
+                {
+                    encoder.setDistortionStatistics(true);
+                    encoder.encode();
+                    psnr = encoder.getStatistics().components[0].peakSignalToNoiseRatio;
+                }
+
+                auto seconds = delta.tv_sec + delta.tv_nsec / 1000000000.0;
+                auto megaPixels = (double)(fixture.frameInfo.width * fixture.frameInfo.height) / (1024.0 * 1024.0) * iterations;
+                auto ratio = (double)rawBytes.size() / (double)encoder.getEncodedBytes().size();
+                printf("NATIVE preset %s %s %s TPF=%.3f ms (%.2f MP/s) ratio=%.3f PSNR=%.2f dB\n", presetNames[preset], mode.name, fixture.path, seconds * 1000.0 / iterations, megaPixels / seconds, ratio, psnr);
+
+                totalMegaPixels += megaPixels;
+                totalSeconds += seconds;
+                totalRawBytes += rawBytes.size();
+                totalEncodedBytes += encoder.getEncodedBytes().size();
+                totalPSNR += psnr;
+            }
+            const size_t numFixtures = sizeof(fixtures) / sizeof(fixtures[0]);
+            printf("NATIVE preset %s %s TOTAL %.2f MP/s ratio=%.3f mean PSNR=%.2f dB\n", presetNames[preset], mode.name, totalMegaPixels / totalSeconds, totalRawBytes / totalEncodedBytes, totalPSNR / numFixtures);
+        }
+    }
+}
+
 int main(int argc, char **argv)
 {
     kdu_customize_warnings(&pretty_cout);
@@ -195,6 +878,13 @@ int main(int argc, char **argv)
 
     const size_t iterations = (argc > 1) ? atoi(argv[1]) : 2000;
 
+    // cpptest <iterations> presets - compares the encoder presets on the raw fixtures
+    if (argc > 2 && std::string(argv[2]) == "presets")
+    {
+        benchmarkPresets(iterations);
+        return 0;
+    }
+
     //  warm up the decoder and encoder
     try
     {
@@ -203,6 +893,23 @@ int main(int argc, char **argv)
 
         // benchmark
         decodeFile("test/fixtures/j2c/CT1.j2c", iterations);
+        decodeParallelFile("test/fixtures/j2c/CT1.j2c", iterations);
+        encodeBatchFile("test/fixtures/raw/CT1.RAW", {.width = 512, .height = 512, .bitsPerSample = 16, .componentCount = 1, .isSigned = true}, iterations);
+        transcodeFile("test/fixtures/j2k/US1.j2k", NULL, iterations);
+        bool passed = transcodeRoundTrip("test/fixtures/CT1.ll.j2c");
+        passed = restartRoundTrip("test/fixtures/raw/CT1.RAW", {.width = 512, .height = 512, .bitsPerSample = 16, .componentCount = 1, .isSigned = true}) && passed;
+        passed = transformRoundTrip("test/fixtures/raw/CT1.RAW", {.width = 512, .height = 512, .bitsPerSample = 16, .componentCount = 1, .isSigned = true}) && passed;
+        passed = autoPrecisionRoundTrip("test/fixtures/raw/CT1.RAW", {.width = 512, .height = 512, .bitsPerSample = 16, .componentCount = 1, .isSigned = true}) && passed;
+        passed = colorTransformRoundTrip("test/fixtures/raw/US1.RAW", {.width = 640, .height = 480, .bitsPerSample = 8, .componentCount = 3, .isSigned = false}) && passed;
+        passed = jp2RoundTrip("test/fixtures/raw/CT1.RAW", {.width = 512, .height = 512, .bitsPerSample = 16, .componentCount = 1, .isSigned = true}) && passed;
+        passed = markerSegmentRoundTrip("test/fixtures/raw/CT1.RAW", {.width = 512, .height = 512, .bitsPerSample = 16, .componentCount = 1, .isSigned = true}) && passed;
+        passed = tiledRoundTrip("test/fixtures/raw/CT1.RAW", {.width = 512, .height = 512, .bitsPerSample = 16, .componentCount = 1, .isSigned = true}) && passed;
+        passed = progressiveRoundTrip("test/fixtures/raw/CT1.RAW", {.width = 512, .height = 512, .bitsPerSample = 16, .componentCount = 1, .isSigned = true}) && passed;
+        passed = regionOfInterestRoundTrip("test/fixtures/raw/CT1.RAW", {.width = 512, .height = 512, .bitsPerSample = 16, .componentCount = 1, .isSigned = true}) && passed;
+        if (!passed)
+        {
+            return 1;
+        }
         // decodeFile("test/fixtures/j2c/MG1.j2c", iterations);
         //  encodeFile("test/fixtures/raw/CT1.RAW", {.width = 512, .height = 512, .bitsPerSample = 16, .componentCount = 1, .isSigned = true}, NULL, iterations);
 
@@ -0,0 +1,115 @@
+// Copyright (c) Chris Hafey.
+// SPDX-License-Identifier: MIT
+
+// Benchmarks the Node-API addon (cmake -DKAKADUJS_NAPI=ON), run from test/node:
+//   node napi.js [path to kakadujs.node]
+const kakadujs = require(process.argv[2] || '../../build/src/kakadujs.node');
+const fs = require('fs');
+const os = require('os');
+
+async function decode(encodedImagePath, iterations = 1, silent = false) {
+  const decoder = new kakadujs.HTJ2KDecoder();
+  const encodedBitStream = fs.readFileSync(encodedImagePath); // read in place, not copied
+
+  const beginDecode = process.hrtime();
+  for (let i = 0; i < iterations; i++) {
+    await decoder.decode(encodedBitStream);
+  }
+  const decodeDuration = process.hrtime(beginDecode);
+  const frameInfo = decoder.getFrameInfo();
+  report('decode', encodedImagePath, frameInfo, decodeDuration, iterations, silent);
+}
+
+// one decoder per core, all running on the libuv thread pool at once
+async function decodeParallel(encodedImagePath, iterations = 1, silent = false) {
+  const numWorkers = os.cpus().length;
+  const framesPerWorker = Math.max(Math.floor(iterations / numWorkers), 1);
+  const encodedBitStream = fs.readFileSync(encodedImagePath);
+  const decoders = Array.from({ length: numWorkers }, () => new kakadujs.HTJ2KDecoder());
+
+  const beginDecode = process.hrtime();
+  await Promise.all(decoders.map(async (decoder) => {
+    for (let i = 0; i < framesPerWorker; i++) {
+      await decoder.decode(encodedBitStream);
+    }
+  }));
+  const decodeDuration = process.hrtime(beginDecode);
+  report(`decodeParallel (${numWorkers} decoders)`, encodedImagePath, decoders[0].getFrameInfo(), decodeDuration, framesPerWorker * numWorkers, silent);
+}
+
+// one decoder with Kakadu worker threads, kept from one job to the next
+async function decodeThreaded(encodedImagePath, iterations = 1, silent = false) {
+  const decoder = new kakadujs.HTJ2KDecoder();
+  decoder.setNumThreads(Math.max(os.cpus().length - 1, 1));
+  const encodedBitStream = fs.readFileSync(encodedImagePath);
+
+  const beginDecode = process.hrtime();
+  for (let i = 0; i < iterations; i++) {
+    await decoder.decode(encodedBitStream);
+  }
+  const decodeDuration = process.hrtime(beginDecode);
+  report('decodeThreaded', encodedImagePath, decoder.getFrameInfo(), decodeDuration, iterations, silent);
+  decoder.releaseThreads();
+}
+
+// a corrupt codestream decoded with worker threads must reject with Kakadu's
+// message, wherever the error was raised
+async function decodeCorrupt(encodedImagePath) {
+  const decoder = new kakadujs.HTJ2KDecoder();
+  decoder.setNumThreads(Math.max(os.cpus().length - 1, 1));
+  const encodedBitStream = Buffer.from(fs.readFileSync(encodedImagePath));
+  for (let i = 200; i < encodedBitStream.length; i += 7) {
+    encodedBitStream[i] ^= 0x5a;
+  }
+  try {
+    await decoder.decode(encodedBitStream);
+    console.log(`NAPI decodeCorrupt ${encodedImagePath}: decoded (Kakadu tolerated the damage)`);
+  } catch (error) {
+    const generic = error.message === 'kakadujs: Kakadu error';
+    console.log(`NAPI decodeCorrupt ${encodedImagePath}: ${generic ? 'MISSING MESSAGE' : 'rejected with the Kakadu message'}`);
+    if (generic) {
+      process.exitCode = 1;
+    }
+  }
+  decoder.releaseThreads();
+}
+
+async function encode(pathToUncompressedImageFrame, frameInfo, iterations = 1, silent = false) {
+  const encoder = new kakadujs.HTJ2KEncoder();
+  const uncompressedImageFrame = fs.readFileSync(pathToUncompressedImageFrame);
+
+  const encodeBegin = process.hrtime();
+  for (let i = 0; i < iterations; i++) {
+    await encoder.encode(uncompressedImageFrame, frameInfo);
+  }
+  const encodeDuration = process.hrtime(encodeBegin);
+  report('encode', pathToUncompressedImageFrame, frameInfo, encodeDuration, iterations, silent);
+}
+
+function report(operation, path, frameInfo, duration, iterations, silent) {
+  const durationInSeconds = duration[0] + duration[1] / 1000000000;
+  const timePerFrameMS = (durationInSeconds / iterations) * 1000;
+  const megaPixels = (frameInfo.width * frameInfo.height) / (1024.0 * 1024.0);
+  const fps = 1000 / timePerFrameMS;
+  const mps = megaPixels * fps;
+  if (!silent) {
+    console.log(`NAPI ${operation} ${path} TotalTime: ${durationInSeconds.toFixed(3)} s for ${iterations} iterations; TPF=${timePerFrameMS.toFixed(3)} ms (${mps.toFixed(2)} MP/s, ${fps.toFixed(2)} FPS)`);
+  }
+}
+
+(async () => {
+  const ct1 = { width: 512, height: 512, bitsPerSample: 16, componentCount: 1, isSigned: true };
+
+  // warm up
+  await decode('../fixtures/j2c/CT2.j2c', 1, true);
+  await encode('../fixtures/raw/CT1.RAW', ct1, 1, true);
+
+  // benchmark
+  const iterations = 20;
+  await decode('../fixtures/j2c/CT1.j2c', iterations);
+  await decode('../fixtures/j2c/MG1.j2c', iterations);
+  await decodeParallel('../fixtures/j2c/CT1.j2c', iterations * 10);
+  await decodeThreaded('../fixtures/j2c/MG1.j2c', iterations);
+  await decodeCorrupt('../fixtures/j2c/MG1.j2c');
+  await encode('../fixtures/raw/CT1.RAW', ct1, iterations);
+})();
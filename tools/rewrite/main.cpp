@@ -0,0 +1,196 @@
+// Copyright (c) Chris Hafey.
+// SPDX-License-Identifier: MIT
+
+// Rewrites an existing JPEG 2000 codestream without decoding it:
+// re-packetizes into a new progression order, adds TLM/PLT markers and
+// splits tile-parts.  The code-blocks, and with them the quality layers, are
+// copied as they are unless --ht or --part1 asks for a block coder
+// conversion (or --rotate/--flip reorients them), which decodes and
+// re-encodes the blocks into a single layer.  --region crops to whole tiles.
+// See HTJ2KTranscoder.hpp
+
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <HTJ2KTranscoder.hpp>
+
+class kdu_stream_message : public kdu_core::kdu_thread_safe_message
+{
+public: // Member classes
+    kdu_stream_message(std::ostream *stream)
+    {
+        this->stream = stream;
+    }
+    void put_text(const char *string)
+    {
+        (*stream) << string;
+    }
+    void flush(bool end_of_message = false)
+    {
+        stream->flush();
+        kdu_thread_safe_message::flush(end_of_message);
+    }
+
+private: // Data
+    std::ostream *stream;
+};
+
+static kdu_stream_message cout_message(&std::cout);
+static kdu_stream_message cerr_message(&std::cerr);
+static kdu_core::kdu_message_formatter pretty_cout(&cout_message);
+static kdu_core::kdu_message_formatter pretty_cerr(&cerr_message);
+
+static bool readFile(const char *fileName, std::vector<uint8_t> &vec)
+{
+    std::ifstream file(fileName, std::ios::in | std::ios::binary);
+    if (file.fail())
+    {
+        return false;
+    }
+    vec.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return true;
+}
+
+static bool writeFile(const char *fileName, const std::vector<uint8_t> &vec)
+{
+    std::ofstream file(fileName, std::ios::out | std::ios::binary);
+    file.write((const char *)vec.data(), vec.size());
+    return !file.fail();
+}
+
+static int progressionOrderFromName(const std::string &name)
+{
+    const char *names[] = {"LRCP", "RLCP", "RPCL", "PCRL", "CPRL"};
+    for (int i = 0; i < 5; i++)
+    {
+        if (name == names[i])
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void usage()
+{
+    printf("usage: htj2k-rewrite <input> <output> [options]\n"
+           "  --order LRCP|RLCP|RPCL|PCRL|CPRL  progression order (default: keep)\n"
+           "  --tlm                             write TLM marker segments\n"
+           "  --plt                             write PLT marker segments\n"
+           "  --tparts R|C                      one tile-part per resolution or component\n"
+           "  --ht                              convert Part-1 code-blocks to HT\n"
+           "  --part1                           convert HT code-blocks to Part-1\n"
+           "  --reduce <levels>                 discard resolution levels\n"
+           "  --rotate 90|180|270               rotate clockwise\n"
+           "  --flip h|v|hv                     mirror horizontally and/or vertically\n"
+           "  --region <x>,<y>,<width>,<height> crop to the tiles covering the region\n");
+}
+
+int main(int argc, char **argv)
+{
+    kdu_customize_warnings(&pretty_cout);
+    kdu_customize_errors(&pretty_cerr);
+
+    if (argc < 3)
+    {
+        usage();
+        return 1;
+    }
+
+    HTJ2KTranscoder transcoder;
+    for (int i = 3; i < argc; i++)
+    {
+        const std::string option = argv[i];
+        const bool hasValue = (i + 1 < argc);
+        if (option == "--order" && hasValue)
+        {
+            const int order = progressionOrderFromName(argv[++i]);
+            if (order < 0)
+            {
+                usage();
+                return 1;
+            }
+            transcoder.setProgressionOrder(order);
+        }
+        else if (option == "--tlm")
+        {
+            transcoder.setTLMEnabled(true);
+        }
+        else if (option == "--plt")
+        {
+            transcoder.setPLTEnabled(true);
+        }
+        else if (option == "--tparts" && hasValue)
+        {
+            const std::string division = argv[++i];
+            transcoder.setTilePartDivision(division == "R" ? 1 : division == "C" ? 2 : 0);
+        }
+        else if (option == "--ht")
+        {
+            transcoder.setHTEnabled(true);
+        }
+        else if (option == "--part1")
+        {
+            transcoder.setHTEnabled(false);
+        }
+        else if (option == "--reduce" && hasValue)
+        {
+            transcoder.setDiscardLevels(atoi(argv[++i]));
+        }
+        else if (option == "--rotate" && hasValue)
+        {
+            transcoder.setRotation(atoi(argv[++i]));
+        }
+        else if (option == "--flip" && hasValue)
+        {
+            const std::string flip = argv[++i];
+            if (flip != "h" && flip != "v" && flip != "hv")
+            {
+                usage();
+                return 1;
+            }
+            transcoder.setFlip(flip.find('h') != std::string::npos, flip.find('v') != std::string::npos);
+        }
+        else if (option == "--region" && hasValue)
+        {
+            unsigned int x, y, width, height;
+            if (sscanf(argv[++i], "%u,%u,%u,%u", &x, &y, &width, &height) != 4 || width == 0 || height == 0)
+            {
+                usage();
+                return 1;
+            }
+            transcoder.setRegion(Point(x, y), Size(width, height));
+        }
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    if (!readFile(argv[1], transcoder.getEncodedBytes()))
+    {
+        printf("File %s does not exist\n", argv[1]);
+        return 1;
+    }
+
+    try
+    {
+        transcoder.transcode();
+    }
+    catch (...)
+    {
+        return 1; // Kakadu has already reported the error
+    }
+
+    if (!writeFile(argv[2], transcoder.getTranscodedBytes()))
+    {
+        printf("Unable to write %s\n", argv[2]);
+        return 1;
+    }
+    return 0;
+}